@@ -1,14 +1,29 @@
 #include "kjson_serialisation.h"
+#include "kjson_simd.h"
 #include "kjson_utils.h"
+#include <climits>
 #include <cmath>
 #include <ctime>
 #include <cstring>  // For memcpy, memcmp
 #include <arpa/inet.h>  // For ntohl, etc.
 #include <cassert>
+#include <cerrno>
 #include <cstdio>  // For snprintf
 #include <sstream>  // For std::ostringstream
+#include <stdexcept>
 #include <string>
+#include <algorithm>
 #include <array>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sys/mman.h>  // For madvise
+#include <sys/stat.h>  // For mkdir
+#include <unistd.h>  // For sysconf
 #include "rapidjson/error/en.h"  // For GetParseError_En
 
 namespace kjson {
@@ -20,9 +35,74 @@ extern "C" {
 
 using GUID = std::array<unsigned char, 16>;
 
+// rapidjson::Writer whose strings and keys are written with the dispatched
+// scan kernel: runs that need no escaping are copied as one block and only
+// the bytes the scan stops at are escaped, with the same output as Writer
+class JsonWriter : public rapidjson::Writer<rapidjson::StringBuffer> {
+public:
+    using Base = rapidjson::Writer<rapidjson::StringBuffer>;
+    using Base::Base;
+
+    bool String(const char* str, rapidjson::SizeType length, bool /*copy*/ = false) {
+        Prefix(rapidjson::kStringType);
+        write_string(str, length);
+        return EndValue(true);
+    }
+    bool String(const char* const& str) {
+        return String(str, static_cast<rapidjson::SizeType>(strlen(str)));
+    }
+    bool Key(const char* str, rapidjson::SizeType length, bool copy = false) {
+        return String(str, length, copy);
+    }
+    bool Key(const char* const& str) {
+        return String(str);
+    }
+
+private:
+    void write_string(const char* str, size_t length) {
+        static const char hex[] = "0123456789ABCDEF";
+        os_->Put('"');
+        size_t pos = 0;
+        while (pos < length) {
+            const size_t run = simd::scan_string(str + pos, length - pos);
+            if (run) {
+                std::memcpy(os_->Push(run), str + pos, run);
+                pos += run;
+            }
+            if (pos == length) {
+                break;
+            }
+
+            const unsigned char c = static_cast<unsigned char>(str[pos++]);
+            char* out;
+            char short_escape = 0;
+            switch (c) {
+                case '"': short_escape = '"'; break;
+                case '\\': short_escape = '\\'; break;
+                case '\b': short_escape = 'b'; break;
+                case '\f': short_escape = 'f'; break;
+                case '\n': short_escape = 'n'; break;
+                case '\r': short_escape = 'r'; break;
+                case '\t': short_escape = 't'; break;
+            }
+            if (short_escape) {
+                out = os_->Push(2);
+                out[0] = '\\';
+                out[1] = short_escape;
+            } else {
+                out = os_->Push(6);
+                std::memcpy(out, "\\u00", 4);
+                out[4] = hex[c >> 4];
+                out[5] = hex[c & 0xf];
+            }
+        }
+        os_->Put('"');
+    }
+};
+
 // Generic function to serialise vectors
 template<typename Writer, typename T, typename EmitFunction>
-void serialise_vector(Writer& w, K x, bool isvec, int i, EmitFunction emit_func) {
+void serialise_vector(Writer& w, K x, bool isvec, J i, EmitFunction emit_func) {
     if (isvec) {
         if (i >= 0) {
             emit_func(w, reinterpret_cast<T*>(x->G0)[i]);
@@ -39,7 +119,7 @@ void serialise_vector(Writer& w, K x, bool isvec, int i, EmitFunction emit_func)
 }
 
 template<typename Writer, typename EmitFunction>
-void serialise_vector(Writer& w, K x, bool isvec, int i, EmitFunction emit_func, U*)
+void serialise_vector(Writer& w, K x, bool isvec, J i, EmitFunction emit_func, U*)
 {
     if (isvec)
     {
@@ -64,7 +144,7 @@ void serialise_vector(Writer& w, K x, bool isvec, int i, EmitFunction emit_func,
 }
 
 template<typename Writer, typename EmitFunction>
-void serialise_vector_enum(Writer& w, K x, bool isvec, int i, EmitFunction emit_func) {
+void serialise_vector_enum(Writer& w, K x, bool isvec, J i, EmitFunction emit_func) {
     if (isvec) {
         if (i >= 0) {
             emit_func(w, kI(x)[i]);
@@ -121,7 +201,7 @@ void emit_sym(Writer& w, S s) {
 }
 
 template<typename Writer>
-void serialise_sym(Writer& w, K x, bool isvec, int i) {
+void serialise_sym(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, S s) {
         emit_sym(w, s);
     };
@@ -143,7 +223,20 @@ void emit_enum_sym(Writer& w, K sym, int sym_idx)
 }
 
 template<typename Writer>
-void serialise_enum_sym(Writer& w, K x, bool isvec, int i)
+void emit_enum_domain(Writer& w, K domain, J idx)
+{
+    if (idx == nj || idx < 0 || idx >= domain->n)
+    {
+        w.Null();
+    }
+    else
+    {
+        w.String(kS(domain)[idx]);
+    }
+}
+
+template<typename Writer>
+void serialise_enum_sym(Writer& w, K x, bool isvec, J i)
 {
     K domain = k(0, (S)"sym", (K)0);
     if (!domain || domain->t != KS)  // Ensure the domain is a symbol list
@@ -154,14 +247,7 @@ void serialise_enum_sym(Writer& w, K x, bool isvec, int i)
     }
 
     auto emit_func = [&](Writer& w, J idx) {
-        if (idx == nj || idx < 0 || idx >= domain->n)
-        {
-            w.Null();
-        }
-        else
-        {
-            w.String(kS(domain)[idx]);
-        }
+        emit_enum_domain(w, domain, idx);
     };
 
     // Use the serialise_vector function with T = J (long)
@@ -176,7 +262,7 @@ void emit_char(Writer& w, C c) {
 }
 
 template<typename Writer>
-void serialise_char(Writer& w, K x, bool isvec, int i) {
+void serialise_char(Writer& w, K x, bool isvec, J i) {
     if (isvec) {
         if (i == -1) {
             w.String(reinterpret_cast<char*>(kC(x)), x->n);
@@ -194,7 +280,7 @@ void emit_bool(Writer& w, G g) {
 }
 
 template<typename Writer>
-void serialise_bool(Writer& w, K x, bool isvec, int i) {
+void serialise_bool(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, G g) {
         emit_bool(w, g);
     };
@@ -209,7 +295,7 @@ void emit_byte(Writer& w, G n) {
 }
 
 template<typename Writer>
-void serialise_byte(Writer& w, K x, bool isvec, int i) {
+void serialise_byte(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, G n) {
         emit_byte(w, n);
     };
@@ -230,7 +316,7 @@ void emit_short(Writer& w, H n) {
 }
 
 template<typename Writer>
-void serialise_short(Writer& w, K x, bool isvec, int i) {
+void serialise_short(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, H n) {
         emit_short(w, n);
     };
@@ -251,7 +337,7 @@ void emit_int(Writer& w, I n) {
 }
 
 template<typename Writer>
-void serialise_int(Writer& w, K x, bool isvec, int i) {
+void serialise_int(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, I n) {
         emit_int(w, n);
     };
@@ -272,7 +358,7 @@ void emit_long(Writer& w, J n) {
 }
 
 template<typename Writer>
-void serialise_long(Writer& w, K x, bool isvec, int i) {
+void serialise_long(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, J n) {
         emit_long(w, n);
     };
@@ -305,7 +391,7 @@ void emit_double(Writer& w, F n) {
 }
 
 template<typename Writer>
-void serialise_float(Writer& w, K x, bool isvec, int i) {
+void serialise_float(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, E n) {
         emit_double(w, n);
     };
@@ -313,7 +399,7 @@ void serialise_float(Writer& w, K x, bool isvec, int i) {
 }
 
 template<typename Writer>
-void serialise_double(Writer& w, K x, bool isvec, int i) {
+void serialise_double(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, F n) {
         emit_double(w, n);
     };
@@ -342,7 +428,7 @@ void emit_date_custom(Writer& w, I n) {
 }
 
 template<typename Writer>
-void serialise_date(Writer& w, K x, bool isvec, int i) {
+void serialise_date(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, I n) {
         emit_date_custom(w, n);
     };
@@ -370,7 +456,7 @@ void emit_time_custom(Writer& w, I n) {
 }
 
 template<typename Writer>
-void serialise_time(Writer& w, K x, bool isvec, int i) {
+void serialise_time(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, I n) {
         emit_time_custom(w, n);
     };
@@ -408,7 +494,7 @@ void emit_timestamp_custom(Writer& w, J n) {
 }
 
 template<typename Writer>
-void serialise_timestamp(Writer& w, K x, bool isvec, int i) {
+void serialise_timestamp(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, J n) {
         emit_timestamp_custom(w, n);
     };
@@ -449,7 +535,7 @@ void emit_timespan_custom(Writer& w, J n) {
 }
 
 template<typename Writer>
-void serialise_timespan(Writer& w, K x, bool isvec, int i) {
+void serialise_timespan(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, J n) {
         emit_timespan_custom(w, n);
     };
@@ -481,7 +567,7 @@ void emit_datetime_custom(Writer& w, F n) {
 }
 
 template<typename Writer>
-void serialise_datetime(Writer& w, K x, bool isvec, int i) {
+void serialise_datetime(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, F n) {
         emit_datetime_custom(w, n);
     };
@@ -507,7 +593,7 @@ void emit_month_custom(Writer& w, I n) {
 }
 
 template<typename Writer>
-void serialise_month(Writer& w, K x, bool isvec, int i) {
+void serialise_month(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, I n) {
         emit_month_custom(w, n);
     };
@@ -533,7 +619,7 @@ void emit_minute_custom(Writer& w, I n) {
 }
 
 template<typename Writer>
-void serialise_minute(Writer& w, K x, bool isvec, int i) {
+void serialise_minute(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, I n) {
         emit_minute_custom(w, n);
     };
@@ -560,7 +646,7 @@ void emit_second_custom(Writer& w, I n) {
 }
 
 template<typename Writer>
-void serialise_second(Writer& w, K x, bool isvec, int i) {
+void serialise_second(Writer& w, K x, bool isvec, J i) {
     auto emit_func = [](Writer& w, I n) {
         emit_second_custom(w, n);
     };
@@ -600,7 +686,7 @@ inline void emit_guid_custom(Writer& w, const U guid_raw)
 }
 
 template<typename Writer>
-void serialise_guid(Writer& w, K x, bool isvec, int i)
+void serialise_guid(Writer& w, K x, bool isvec, J i)
 {
     auto emit_func = [](Writer& w, U u) {
         emit_guid_custom(w, u);
@@ -609,7 +695,7 @@ void serialise_guid(Writer& w, K x, bool isvec, int i)
 }
 
 template<typename Writer>
-void serialise_dict(Writer& w, K x, bool /*isvec*/, int /*i*/) {
+void serialise_dict(Writer& w, K x, bool /*isvec*/, J /*i*/) {
     const K keys = kK(x)[0];
     const K values = kK(x)[1];
 
@@ -626,7 +712,7 @@ void serialise_dict(Writer& w, K x, bool /*isvec*/, int /*i*/) {
 }
 
 template<typename Writer>
-void serialise_list(Writer& w, K x, bool isvec, int i) {
+void serialise_list(Writer& w, K x, bool isvec, J i) {
     if (isvec) {
         if (i >= 0) {
             K v = kK(x)[i];
@@ -645,7 +731,7 @@ void serialise_list(Writer& w, K x, bool isvec, int i) {
 }
 
 template<typename Writer>
-void serialise_table(Writer& w, K x, bool isvec, int i) {
+void serialise_table(Writer& w, K x, bool isvec, J i) {
     const K dict = x->k;
     const K keys = kK(dict)[0];
     const K values = kK(dict)[1];
@@ -674,7 +760,7 @@ void serialise_table(Writer& w, K x, bool isvec, int i) {
 }
 
 template<typename Writer>
-void serialise_atom(Writer& w, const K x, int i) {
+void serialise_atom(Writer& w, const K x, J i) {
     bool isvec = x->t >= 0;
 
     switch (x->t) {
@@ -757,6 +843,7 @@ void serialise_atom(Writer& w, const K x, int i) {
             serialise_table(w, x, isvec, i);
             break;
         case XD:
+        case 127:  // Sorted dictionary
             serialise_dict(w, x, isvec, i);
             break;
         case 20:
@@ -769,50 +856,1851 @@ void serialise_atom(Writer& w, const K x, int i) {
     }
 }
 
-}  // namespace kjson
+// Fallback column serialiser for types without a dedicated kernel
+template<typename Writer>
+void serialise_column(Writer& w, K x, bool /*isvec*/, J i) {
+    serialise_atom(w, x, i);
+}
 
-extern "C" {
+template<typename Writer>
+using ColumnKernel = void (*)(Writer&, K, bool, J);
 
-K handle_parse_error(const rapidjson::Document& document) {
-    std::string errMsg = std::string("Parse error: ") + GetParseError_En(document.GetParseError()) +
-                         " at offset " + std::to_string(document.GetErrorOffset());
-    return krr(const_cast<S>(errMsg.c_str()));
+// Resolve the serialiser for a column type once, instead of going through
+// the serialise_atom switch for every cell
+template<typename Writer>
+ColumnKernel<Writer> column_kernel(signed char t) {
+    switch (t) {
+        case 0:  return serialise_list<Writer>;
+        case KS: return serialise_sym<Writer>;
+        case KC: return serialise_char<Writer>;
+        case KB: return serialise_bool<Writer>;
+        case KG: return serialise_byte<Writer>;
+        case KH: return serialise_short<Writer>;
+        case KI: return serialise_int<Writer>;
+        case KJ: return serialise_long<Writer>;
+        case KE: return serialise_float<Writer>;
+        case KF: return serialise_double<Writer>;
+        case KD: return serialise_date<Writer>;
+        case KZ: return serialise_datetime<Writer>;
+        case KP: return serialise_timestamp<Writer>;
+        case KN: return serialise_timespan<Writer>;
+        case KM: return serialise_month<Writer>;
+        case KU: return serialise_minute<Writer>;
+        case KV: return serialise_second<Writer>;
+        case KT: return serialise_time<Writer>;
+        case UU: return serialise_guid<Writer>;
+        case 20: return serialise_enum_sym<Writer>;
+        default: return serialise_column<Writer>;
+    }
 }
 
-K jtok(K json_string) {
-    if (json_string->t != KC) {
-        return krr(const_cast<S>("Type error: Input must be a char vector (string)"));
+// Escape a column name once into its quoted JSON form
+inline std::string escape_key(S name) {
+    rapidjson::StringBuffer buffer;
+    JsonWriter writer(buffer);
+    writer.String(name);
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+// Serialisation plan compiled from a sample table: interned column names and
+// types for the schema check, pre-escaped keys and per-column kernels
+struct SerialisePlan {
+    bool keyed = false;
+    std::vector<S> names;
+    std::vector<signed char> types;
+    std::vector<std::string> keys;
+    std::vector<ColumnKernel<JsonWriter>> kernels;
+    std::vector<K> columns;  // Scratch space for the columns of the table being serialised
+};
+
+// Add column col of table x to a plan
+inline void add_plan_column(SerialisePlan& plan, K names, K values, J col) {
+    const K column = kK(values)[col];
+    plan.names.push_back(kS(names)[col]);
+    plan.types.push_back(column->t);
+    plan.keys.push_back(escape_key(kS(names)[col]));
+    plan.kernels.push_back(column_kernel<JsonWriter>(column->t));
+    plan.columns.push_back(column);
+}
+
+inline bool compile_plan(SerialisePlan& plan, K x) {
+    K parts[2];
+    const int nparts = table_parts(x, parts);
+    if (nparts == 0) {
+        return false;
+    }
+    plan.keyed = nparts == 2;
+    for (int p = 0; p < nparts; ++p) {
+        const K names = kK(parts[p]->k)[0];
+        const K values = kK(parts[p]->k)[1];
+        for (J col = 0; col < names->n; ++col) {
+            add_plan_column(plan, names, values, col);
+        }
+    }
+    return true;
+}
+
+// Collect the columns of x into plan.columns if x has the plan's schema
+inline bool match_plan(SerialisePlan& plan, K x) {
+    K parts[2];
+    const int nparts = table_parts(x, parts);
+    if (nparts == 0 || (nparts == 2) != plan.keyed) {
+        return false;
+    }
+    size_t idx = 0;
+    for (int p = 0; p < nparts; ++p) {
+        const K names = kK(parts[p]->k)[0];
+        const K values = kK(parts[p]->k)[1];
+        for (int col = 0; col < names->n; ++col, ++idx) {
+            if (idx >= plan.names.size() ||
+                kS(names)[col] != plan.names[idx] ||  // Symbols are interned
+                kK(values)[col]->t != plan.types[idx]) {
+                return false;
+            }
+            plan.columns[idx] = kK(values)[col];
+        }
     }
+    return idx == plan.names.size();
+}
 
-    rapidjson::Document document;
-    document.Parse(reinterpret_cast<const char*>(kC(json_string)), json_string->n);
+// Plan for the named columns of table x, or all of them if cols is not a
+// symbol list. Returns an error message for unknown columns.
+inline const char* project_plan(SerialisePlan& plan, K x, K cols) {
+    const K names = kK(x->k)[0];
+    const K values = kK(x->k)[1];
 
-    if (document.HasParseError()) {
-        return handle_parse_error(document);
+    if (cols->t != KS) {
+        for (J col = 0; col < names->n; ++col) {
+            add_plan_column(plan, names, values, col);
+        }
+        return nullptr;
     }
 
-    try {
-        return kjson::json_to_kobject(document);
-    } catch (const std::exception& e) {
-        return krr(const_cast<S>(e.what()));
+    for (J idx = 0; idx < cols->n; ++idx) {
+        J col = 0;
+        while (col < names->n && kS(names)[col] != kS(cols)[idx]) {  // Symbols are interned
+            ++col;
+        }
+        if (col == names->n) {
+            return "Column error: Unknown column";
+        }
+        add_plan_column(plan, names, values, col);
     }
+    return nullptr;
 }
 
-K ktoj(K x) {
+template<typename Writer>
+void serialise_plan_row(Writer& w, const SerialisePlan& plan, J row) {
+    w.StartObject();
+    for (size_t col = 0; col < plan.columns.size(); ++col) {
+        w.RawValue(plan.keys[col].data(), plan.keys[col].size(), rapidjson::kStringType);
+        plan.kernels[col](w, plan.columns[col], true, row);
+    }
+    w.EndObject();
+}
+
+template<typename Writer>
+void serialise_with_plan(Writer& w, const SerialisePlan& plan) {
+    const int rows = plan.columns.empty() ? 0 : plan.columns[0]->n;
+
+    w.StartArray();
+    for (int row = 0; row < rows; ++row) {
+        serialise_plan_row(w, plan, row);
+    }
+    w.EndArray();
+}
+
+// Serialise the rows of a plan selected by an index vector, a list of
+// (start;count) ranges, or all rows for anything else
+template<typename Writer>
+const char* serialise_plan_rows(Writer& w, const SerialisePlan& plan, J count, K rows) {
+    auto valid = [count](J row) { return row >= 0 && row < count; };
+
+    w.StartArray();
+    switch (rows->t) {
+        case KJ:
+            for (J idx = 0; idx < rows->n; ++idx) {
+                if (!valid(kJ(rows)[idx])) return "Index error: Row index out of range";
+                serialise_plan_row(w, plan, kJ(rows)[idx]);
+            }
+            break;
+        case KI:
+            for (J idx = 0; idx < rows->n; ++idx) {
+                if (!valid(kI(rows)[idx])) return "Index error: Row index out of range";
+                serialise_plan_row(w, plan, kI(rows)[idx]);
+            }
+            break;
+        case 0:
+            for (J idx = 0; idx < rows->n; ++idx) {
+                const K range = kK(rows)[idx];
+                if (range->t != KJ || range->n != 2) return "Type error: Row ranges must be (start;count) long pairs";
+                // Empty ranges may start at count, so (count;0) and (0;0) on an empty table are fine
+                const J start = kJ(range)[0];
+                const J length = kJ(range)[1];
+                if (start < 0 || start > count || length < 0 || length > count - start) return "Index error: Row range out of range";
+                for (J row = start; row < start + length; ++row) {
+                    serialise_plan_row(w, plan, row);
+                }
+            }
+            break;
+        default:
+            for (J row = 0; row < count; ++row) {
+                serialise_plan_row(w, plan, row);
+            }
+            break;
+    }
+    w.EndArray();
+    return nullptr;
+}
+
+// Rows of a mapped nested column materialised at a time
+constexpr J EXPORT_CHUNK_ROWS = 65536;
+
+// One partition of an HDB export. Everything that touches K reference counts
+// happens on the main thread; workers only read the mapped columns.
+struct ExportPartition {
+    std::string name;     // Partition directory, e.g. 2024.01.02
+    std::string field;    // Pre-escaped key of the virtual partition column
+    std::string value;    // Pre-rendered JSON value of the partition
+    K table = nullptr;
+    SerialisePlan plan;
+    J rows = 0;
+    bool missing = false;  // No such partition directory; skipped
+    std::string error;
+    std::vector<uint8_t> is_enum;  // Plan columns enumerated against sym
+
+    // Mapped nested columns (e.g. strings) cannot be read from C, so the
+    // main thread indexes them into plain lists a chunk of rows at a time,
+    // on request from the worker, and plan.columns holds the current chunk
+    std::vector<size_t> nested;  // Plan columns that are nested
+    std::vector<K> mapped;       // Their mapped form
+    std::vector<uint8_t> is_nested;
+    J chunk_start = 0;
+    J chunk_rows = 0;
+    bool requested = false;
+
+    void release_chunk() {
+        for (size_t idx = 0; idx < nested.size(); ++idx) {
+            if (plan.columns[nested[idx]] != mapped[idx]) r0(plan.columns[nested[idx]]);
+        }
+    }
+};
+
+// Chunk requests from export workers, served by the main thread
+struct ExportChunks {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<ExportPartition*> requests;
+    size_t active = 0;  // Workers still running
+
+    // Worker side: wait for rows [start, start + count) of the nested columns
+    void fetch(ExportPartition& part, J start, J count) {
+        std::unique_lock<std::mutex> lock(mutex);
+        part.chunk_start = start;
+        part.chunk_rows = count;
+        part.requested = true;
+        requests.push_back(&part);
+        cv.notify_all();
+        cv.wait(lock, [&part] { return !part.requested; });
+    }
+
+    void finished() {
+        std::lock_guard<std::mutex> lock(mutex);
+        --active;
+        cv.notify_all();
+    }
+
+    // Main thread: materialise requested chunks until every worker is done
+    void serve() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait(lock, [this] { return !requests.empty() || active == 0; });
+            if (requests.empty()) {
+                return;
+            }
+            ExportPartition* part = requests.front();
+            requests.pop_front();
+            lock.unlock();
+            load_chunk(*part);
+            lock.lock();
+            part->requested = false;
+            cv.notify_all();
+        }
+    }
+
+    static void load_chunk(ExportPartition& part) {
+        part.release_chunk();
+        for (size_t idx = 0; idx < part.nested.size(); ++idx) {
+            const size_t col = part.nested[idx];
+            K chunk = k(0, const_cast<S>("{x y+til z}"), r1(part.mapped[idx]), kj(part.chunk_start), kj(part.chunk_rows), (K)0);
+            if (!chunk || chunk->t != 0) {
+                if (chunk) r0(chunk);
+                part.error = "Type error: Unable to read nested column";
+                chunk = ktn(0, 0);
+            }
+            part.plan.columns[col] = chunk;
+        }
+    }
+};
+
+// Directory name and virtual column of a partition, as kdb+ names them
+inline bool partition_name(K parts, J idx, std::string& name, std::string& field, std::string& value) {
+    char buff[32];
+    switch (parts->t) {
+        case KD: {
+            const I n = kI(parts)[idx];
+            time_t tt = static_cast<time_t>(n + 10957) * 86400;
+            struct tm timinfo;
+            gmtime_r(&tt, &timinfo);
+            snprintf(buff, sizeof(buff), "%04d.%02d.%02d", timinfo.tm_year + 1900, timinfo.tm_mon + 1, timinfo.tm_mday);
+            field = "date";
+            break;
+        }
+        case KM: {
+            const I n = kI(parts)[idx];
+            snprintf(buff, sizeof(buff), "%04d.%02d", n / 12 + 2000, n % 12 + 1);
+            field = "month";
+            break;
+        }
+        case KI:
+            snprintf(buff, sizeof(buff), "%d", kI(parts)[idx]);
+            field = "int";
+            break;
+        case KJ:
+            snprintf(buff, sizeof(buff), "%lld", kJ(parts)[idx]);
+            field = "int";
+            break;
+        default:
+            return false;
+    }
+    name = buff;
+
     rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    JsonWriter writer(buffer);
+    serialise_atom(writer, parts, idx);
+    value.assign(buffer.GetString(), buffer.GetSize());
+    field = escape_key(const_cast<S>(field.c_str()));
+    return true;
+}
+
+// Hint that a mapped column is about to be read front to back
+inline void advise_sequential(K column) {
+    const int width = column->t == KB || column->t == KG || column->t == KC ? 1 :
+                      column->t == KH ? 2 :
+                      column->t == KI || column->t == KE || column->t == KM || column->t == KD ||
+                      column->t == KU || column->t == KV || column->t == KT ? 4 :
+                      column->t == UU ? 16 : 8;
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t start = reinterpret_cast<uintptr_t>(kG(column)) & ~(page - 1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(kG(column)) + column->n * width;
+    madvise(reinterpret_cast<void*>(start), end - start, MADV_SEQUENTIAL);
+}
+
+// Write one partition as NDJSON, one object per row
+inline void export_partition(ExportPartition& part, const std::string& path, K domain, ExportChunks& chunks) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        part.error = "File error: Unable to open " + path;
+        return;
+    }
 
+    const SerialisePlan& plan = part.plan;
+    const size_t ncols = plan.columns.size();
+    const J rows = part.rows;
+
+    rapidjson::StringBuffer buffer;
+    JsonWriter writer(buffer);
     writer.SetMaxDecimalPlaces(5);
 
-    try {
-        kjson::serialise_atom(writer, x, -1);
+    for (J row = 0; row < rows; ++row) {
+        if (!part.nested.empty() && row == part.chunk_start + part.chunk_rows) {
+            chunks.fetch(part, row, std::min<J>(EXPORT_CHUNK_ROWS, rows - row));
+            if (!part.error.empty()) {
+                fclose(file);
+                return;
+            }
+        }
+        writer.Reset(buffer);
+        writer.StartObject();
+        writer.RawValue(part.field.data(), part.field.size(), rapidjson::kStringType);
+        writer.RawValue(part.value.data(), part.value.size(), rapidjson::kStringType);
+        for (size_t col = 0; col < ncols; ++col) {
+            const K column = plan.columns[col];
+            writer.RawValue(plan.keys[col].data(), plan.keys[col].size(), rapidjson::kStringType);
+            if (part.is_nested[col]) {
+                plan.kernels[col](writer, column, true, row - part.chunk_start);
+            } else if (part.is_enum[col]) {
+                // Resolved against the HDB sym file, not the session's sym
+                emit_enum_domain(writer, domain, kJ(column)[row]);
+            } else {
+                plan.kernels[col](writer, column, true, row);
+            }
+        }
+        writer.EndObject();
+        buffer.Put('\n');
 
-        size_t len = buffer.GetSize();
-        const char* str = buffer.GetString();
+        if (buffer.GetSize() >= (1 << 20)) {
+            fwrite(buffer.GetString(), 1, buffer.GetSize(), file);
+            buffer.Clear();
+        }
+    }
+    fwrite(buffer.GetString(), 1, buffer.GetSize(), file);
+
+    if (fclose(file) != 0) {
+        part.error = "File error: Unable to write " + path;
+    }
+}
+
+inline std::string strip_handle(S s) {
+    return s[0] == ':' ? s + 1 : s;
+}
+
+// One object of a kdb+ IPC message, pointing into the message bytes.
+// Vectors are read in place; symbol elements and the parts of lists,
+// dictionaries and tables are located once so they can be indexed by row.
+struct IpcView {
+    signed char t = 0;
+    const char* data = nullptr;     // Atom value or first vector element
+    J n = 0;
+    std::vector<const char*> syms;  // Symbol vector elements
+    std::vector<IpcView> parts;     // List elements, or the keys and values of a dictionary or table
+};
+
+// Bytes per element of a fixed-width IPC vector type, 0 for symbols and
+// -1 for types that are not vectors
+inline int ipc_width(signed char t) {
+    switch (t) {
+        case KB: case KG: case KC: return 1;
+        case KH: return 2;
+        case KI: case KE: case KM: case KD: case KU: case KV: case KT: return 4;
+        case KJ: case KF: case KP: case KZ: case KN: return 8;
+        case UU: return 16;
+        case KS: return 0;
+        default: return -1;
+    }
+}
+
+template<typename T>
+inline T ipc_load(const char* p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+class IpcReader {
+public:
+    explicit IpcReader(const char* end) : end_(end) {}
+
+    // Read the object at p into v and return the position after it
+    const char* read(const char* p, IpcView& v) {
+        need(p, 1);
+        v.t = static_cast<signed char>(*p++);
+
+        if (v.t < 0) {
+            if (v.t == -KS) {
+                v.data = p;
+                return skip_sym(p);
+            }
+            if (v.t == -128) {
+                throw std::runtime_error("IPC error: Message is an error");
+            }
+            const int width = ipc_width(-v.t);
+            if (width <= 0) {
+                throw std::runtime_error("Type error: Unsupported type in IPC message");
+            }
+            need(p, width);
+            v.data = p;
+            return p + width;
+        }
+
+        if (v.t < 20) {
+            need(p, 5);
+            const J n = ipc_load<int32_t>(p + 1);  // After the attribute byte
+            p += 5;
+            if (n < 0) {
+                throw std::runtime_error("IPC error: Malformed vector");
+            }
+            v.n = n;
+            if (v.t == 0) {
+                v.parts.resize(n);
+                for (IpcView& part : v.parts) {
+                    p = read(p, part);
+                }
+                return p;
+            }
+            if (v.t == KS) {
+                v.syms.reserve(n);
+                for (J idx = 0; idx < n; ++idx) {
+                    v.syms.push_back(p);
+                    p = skip_sym(p);
+                }
+                return p;
+            }
+            const int width = ipc_width(v.t);
+            if (width < 0) {
+                throw std::runtime_error("Type error: Unsupported type in IPC message");
+            }
+            need(p, n * width);
+            v.data = p;
+            return p + n * width;
+        }
+
+        switch (v.t) {
+            case XT: {
+                need(p, 1);
+                IpcView dict;
+                p = read(p + 1, dict);  // After the attribute byte
+                if (dict.t != XD || dict.parts[0].t != KS || dict.parts[1].t != 0 ||
+                    dict.parts[0].n != dict.parts[1].n) {
+                    throw std::runtime_error("IPC error: Malformed table");
+                }
+                v.parts = std::move(dict.parts);
+                v.n = v.parts[1].parts.empty() ? 0 : v.parts[1].parts[0].n;
+                for (const IpcView& column : v.parts[1].parts) {
+                    if (column.t < 0 || column.t >= 20 || column.n != v.n) {
+                        throw std::runtime_error("IPC error: Malformed table");
+                    }
+                }
+                return p;
+            }
+            case XD:
+            case 127:  // Sorted dictionary
+                v.parts.resize(2);
+                p = read(p, v.parts[0]);
+                p = read(p, v.parts[1]);
+                if (v.parts[0].t < 0 || v.parts[1].t < 0 || v.parts[0].n != v.parts[1].n) {
+                    throw std::runtime_error("IPC error: Malformed dictionary");
+                }
+                v.n = v.parts[0].n;
+                return p;
+            case 100: {  // Lambda: context and source
+                IpcView source;
+                return read(skip_sym(p), source);
+            }
+            case 101: case 102: case 103:  // Primitives
+                need(p, 1);
+                return p + 1;
+            case 104: case 105: {  // Projection, composition
+                need(p, 4);
+                const J n = ipc_load<int32_t>(p);
+                p += 4;
+                for (J idx = 0; idx < n; ++idx) {
+                    IpcView part;
+                    p = read(p, part);
+                }
+                return p;
+            }
+            case 106: case 107: case 108: case 109: case 110: case 111: {  // Iterators
+                IpcView part;
+                return read(p, part);
+            }
+            default:
+                throw std::runtime_error("Type error: Unsupported type in IPC message");
+        }
+    }
+
+private:
+    void need(const char* p, J n) const {
+        if (n < 0 || end_ - p < n) {
+            throw std::runtime_error("IPC error: Message is truncated");
+        }
+    }
+
+    const char* skip_sym(const char* p) const {
+        const void* nul = p < end_ ? std::memchr(p, 0, end_ - p) : nullptr;
+        if (!nul) {
+            throw std::runtime_error("IPC error: Message is truncated");
+        }
+        return static_cast<const char*>(nul) + 1;
+    }
+
+    const char* end_;
+};
+
+// Expand a compressed IPC message, header included, using the kdb+ IPC
+// compression scheme. Returns false if the input is malformed.
+inline bool ipc_decompress(const unsigned char* src, size_t len, std::vector<char>& out) {
+    if (len < 12) {
+        return false;
+    }
+    const int32_t total = ipc_load<int32_t>(reinterpret_cast<const char*>(src) + 8);
+    if (total < 8) {
+        return false;
+    }
+    out.assign(total, 0);
+    unsigned char* dst = reinterpret_cast<unsigned char*>(out.data());
+    std::memcpy(dst, src, 4);
+    std::memcpy(dst + 4, &total, 4);
+    dst[2] = 0;
+
+    size_t positions[256] = {0};
+    size_t s = 8, p = 8, d = 12, n = 0;
+    unsigned flags = 0, bit = 0;
+    while (s < static_cast<size_t>(total)) {
+        if (bit == 0) {
+            if (d >= len) return false;
+            flags = src[d++];
+            bit = 1;
+        }
+        if (flags & bit) {
+            // Back reference: a hashed earlier position, two bytes plus n more
+            if (d + 2 > len || s + 2 > static_cast<size_t>(total)) return false;
+            size_t r = positions[src[d++]];
+            dst[s++] = dst[r++];
+            dst[s++] = dst[r++];
+            n = src[d++];
+            if (s + n > static_cast<size_t>(total)) return false;
+            for (size_t m = 0; m < n; ++m) {
+                dst[s + m] = dst[r + m];
+            }
+        } else {
+            if (d >= len) return false;
+            dst[s++] = src[d++];
+        }
+        while (p < s - 1) {
+            positions[dst[p] ^ dst[p + 1]] = p;
+            ++p;
+        }
+        if (flags & bit) {
+            p = s += n;
+        }
+        bit = (bit * 2) & 0xff;
+    }
+    return true;
+}
+
+// One element of a fixed-width vector or atom of type t, formatted as
+// serialise_atom formats it
+template<typename Writer>
+void emit_ipc_value(Writer& w, signed char t, const char* p) {
+    switch (t < 0 ? -t : t) {
+        case KB: emit_bool(w, ipc_load<G>(p)); break;
+        case KG: emit_byte(w, ipc_load<G>(p)); break;
+        case KH: emit_short(w, ipc_load<H>(p)); break;
+        case KI: emit_int(w, ipc_load<I>(p)); break;
+        case KJ: emit_long(w, ipc_load<J>(p)); break;
+        case KE: emit_double(w, ipc_load<E>(p)); break;
+        case KF: emit_double(w, ipc_load<F>(p)); break;
+        case KC: emit_char(w, ipc_load<C>(p)); break;
+        case KP: emit_timestamp_custom(w, ipc_load<J>(p)); break;
+        case KM: emit_month_custom(w, ipc_load<I>(p)); break;
+        case KD: emit_date_custom(w, ipc_load<I>(p)); break;
+        case KZ: emit_datetime_custom(w, ipc_load<F>(p)); break;
+        case KN: emit_timespan_custom(w, ipc_load<J>(p)); break;
+        case KU: emit_minute_custom(w, ipc_load<I>(p)); break;
+        case KV: emit_second_custom(w, ipc_load<I>(p)); break;
+        case KT: emit_time_custom(w, ipc_load<I>(p)); break;
+        case UU: emit_guid_custom(w, ipc_load<U>(p)); break;
+        default: w.Null(); break;
+    }
+}
+
+// serialise_atom for an IPC view: element i of a vector, list, dictionary
+// or table, or the whole object when i is -1
+template<typename Writer>
+void serialise_ipc(Writer& w, const IpcView& v, J i) {
+    if (v.t < 0) {
+        if (v.t == -KS) {
+            emit_sym(w, const_cast<S>(v.data));
+        } else {
+            emit_ipc_value(w, v.t, v.data);
+        }
+        return;
+    }
+
+    switch (v.t) {
+        case 0:
+            if (i >= 0) {
+                serialise_ipc(w, v.parts[i], -1);
+            } else {
+                w.StartArray();
+                for (const IpcView& part : v.parts) {
+                    serialise_ipc(w, part, -1);
+                }
+                w.EndArray();
+            }
+            break;
+        case KS:
+            if (i >= 0) {
+                emit_sym(w, const_cast<S>(v.syms[i]));
+            } else {
+                w.StartArray();
+                for (const char* s : v.syms) {
+                    emit_sym(w, const_cast<S>(s));
+                }
+                w.EndArray();
+            }
+            break;
+        case KC:
+            if (i >= 0) {
+                emit_char(w, v.data[i]);
+            } else {
+                w.String(v.data, v.n);
+            }
+            break;
+        case XT: {
+            const IpcView& names = v.parts[0];
+            const std::vector<IpcView>& columns = v.parts[1].parts;
+            auto row = [&](J r) {
+                w.StartObject();
+                for (J col = 0; col < names.n; ++col) {
+                    emit_sym(w, const_cast<S>(names.syms[col]));
+                    serialise_ipc(w, columns[col], r);
+                }
+                w.EndObject();
+            };
+            if (i >= 0) {
+                row(i);
+            } else {
+                w.StartArray();
+                for (J r = 0; r < v.n; ++r) {
+                    row(r);
+                }
+                w.EndArray();
+            }
+            break;
+        }
+        case XD:
+        case 127: {  // Sorted dictionary or keyed table
+            const IpcView& keys = v.parts[0];
+            const IpcView& values = v.parts[1];
+            if (keys.t == XT && values.t == XT) {
+                // Keyed table: each row merges the key and value columns
+                w.StartArray();
+                for (J r = 0; r < keys.n; ++r) {
+                    w.StartObject();
+                    for (const IpcView* part : {&keys, &values}) {
+                        for (J col = 0; col < part->parts[0].n; ++col) {
+                            emit_sym(w, const_cast<S>(part->parts[0].syms[col]));
+                            serialise_ipc(w, part->parts[1].parts[col], r);
+                        }
+                    }
+                    w.EndObject();
+                }
+                w.EndArray();
+            } else {
+                w.StartObject();
+                for (J idx = 0; idx < keys.n; ++idx) {
+                    serialise_ipc(w, keys, idx);
+                    serialise_ipc(w, values, idx);
+                }
+                w.EndObject();
+            }
+            break;
+        }
+        default:
+            if (v.t < 20 && v.data) {
+                if (i >= 0) {
+                    emit_ipc_value(w, v.t, v.data + i * ipc_width(v.t));
+                } else {
+                    const int width = ipc_width(v.t);
+                    w.StartArray();
+                    for (J idx = 0; idx < v.n; ++idx) {
+                        emit_ipc_value(w, v.t, v.data + idx * width);
+                    }
+                    w.EndArray();
+                }
+            } else {
+                w.Null();
+            }
+            break;
+    }
+}
 
-        return kpn(const_cast<S>(str), len);
+// Row fingerprints for delta serialisation. Each column is folded into the
+// running hash of every row in one pass over its vector.
+constexpr uint64_t FINGERPRINT_K0 = 0xa0761d6478bd642fULL;
+constexpr uint64_t FINGERPRINT_K1 = 0xe7037ed1a0b428dbULL;
+
+inline uint64_t fingerprint_fold(uint64_t h, uint64_t v) {
+    return hash_mix(h ^ v, FINGERPRINT_K1);
+}
+
+inline uint64_t fingerprint_load(const char* p, int width) {
+    uint64_t v = 0;
+    std::memcpy(&v, p, width < 8 ? width : 8);
+    if (width == 16) {
+        uint64_t high;
+        std::memcpy(&high, p + 8, 8);
+        v = hash_mix(v ^ FINGERPRINT_K0, high ^ FINGERPRINT_K1);
+    }
+    return v;
+}
+
+// Enumerations hold long indices into their domain
+inline int fingerprint_width(signed char t) {
+    return t >= 20 && t <= 76 ? 8 : ipc_width(t);
+}
+
+inline bool fingerprint_real(signed char t) {
+    return t == KF || t == KE || t == KZ;
+}
+
+// Floats are taken by value, so every NaN is alike and -0.0 is 0.0, and the
+// same data does not look changed because of a different NaN payload
+inline uint64_t fingerprint_value(const char* p, signed char t, int width) {
+    if (!fingerprint_real(t)) {
+        return fingerprint_load(p, width);
+    }
+    F f;
+    if (t == KE) {
+        E e;
+        std::memcpy(&e, p, sizeof(e));
+        f = e;
+    } else {
+        std::memcpy(&f, p, sizeof(f));
+    }
+    if (std::isnan(f)) {
+        return FINGERPRINT_K1;
+    }
+    if (f == 0) {
+        f = 0;
+    }
+    uint64_t v;
+    std::memcpy(&v, &f, sizeof(v));
+    return v;
+}
+
+uint64_t fingerprint_object(K x) {
+    uint64_t h = fingerprint_fold(FINGERPRINT_K0, static_cast<uint64_t>(x->t));
+    if (x->t < 0) {
+        if (x->t == -KS) {
+            return fingerprint_fold(h, reinterpret_cast<uint64_t>(x->s));  // Symbols are interned
+        }
+        const int width = fingerprint_width(-x->t);
+        // Guid atoms keep their bytes where a vector's data would be
+        const char* data = x->t == -UU ? reinterpret_cast<const char*>(kG(x)) : reinterpret_cast<const char*>(&x->g);
+        return width > 0 ? fingerprint_fold(h, fingerprint_value(data, -x->t, width)) : h;
+    }
+    if (x->t == XT) {
+        return fingerprint_fold(h, fingerprint_object(x->k));
+    }
+    if (x->t >= 100) {
+        return h;
+    }
+    h = fingerprint_fold(h, static_cast<uint64_t>(x->n));
+    if (x->t == 0 || x->t == XD) {
+        for (J idx = 0; idx < x->n; ++idx) {
+            h = fingerprint_fold(h, fingerprint_object(kK(x)[idx]));
+        }
+        return h;
+    }
+    if (x->t == KS) {
+        for (J idx = 0; idx < x->n; ++idx) {
+            h = fingerprint_fold(h, reinterpret_cast<uint64_t>(kS(x)[idx]));
+        }
+        return h;
+    }
+    const int width = fingerprint_width(x->t);
+    if (fingerprint_real(x->t)) {
+        for (J idx = 0; idx < x->n; ++idx) {
+            h = fingerprint_fold(h, fingerprint_value(reinterpret_cast<const char*>(kG(x)) + idx * width, x->t, width));
+        }
+        return h;
+    }
+    return width > 0 ? fingerprint_fold(h, hash_bytes(reinterpret_cast<const char*>(kG(x)), x->n * width)) : h;
+}
+
+// Whether two objects hold the same values, comparing floats as they are
+// fingerprinted. Used to confirm a key fingerprint match.
+bool fingerprint_equal(K a, K b);
+
+inline bool fingerprint_cells_equal(K a, J i, K b, J j) {
+    if (a->t != b->t) {
+        return false;
+    }
+    switch (a->t) {
+        case 0:
+            return fingerprint_equal(kK(a)[i], kK(b)[j]);
+        case KS:
+            return kS(a)[i] == kS(b)[j];
+        default: {
+            const int width = fingerprint_width(a->t);
+            if (width <= 0) {
+                return true;
+            }
+            const char* p = reinterpret_cast<const char*>(kG(a)) + i * width;
+            const char* q = reinterpret_cast<const char*>(kG(b)) + j * width;
+            return fingerprint_real(a->t) ? fingerprint_value(p, a->t, width) == fingerprint_value(q, a->t, width)
+                                          : std::memcmp(p, q, width) == 0;
+        }
+    }
+}
+
+bool fingerprint_equal(K a, K b) {
+    if (a == b) {
+        return true;
+    }
+    if (a->t != b->t) {
+        return false;
+    }
+    if (a->t < 0) {
+        if (a->t == -KS) {
+            return a->s == b->s;
+        }
+        const int width = fingerprint_width(-a->t);
+        const char* p = a->t == -UU ? reinterpret_cast<const char*>(kG(a)) : reinterpret_cast<const char*>(&a->g);
+        const char* q = b->t == -UU ? reinterpret_cast<const char*>(kG(b)) : reinterpret_cast<const char*>(&b->g);
+        return width <= 0 || fingerprint_value(p, -a->t, width) == fingerprint_value(q, -a->t, width);
+    }
+    if (a->t == XT) {
+        return fingerprint_equal(a->k, b->k);
+    }
+    if (a->t >= 100 || a->n != b->n) {
+        return false;
+    }
+    for (J idx = 0; idx < a->n; ++idx) {
+        const bool equal = a->t == XD ? fingerprint_equal(kK(a)[idx], kK(b)[idx]) : fingerprint_cells_equal(a, idx, b, idx);
+        if (!equal) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fold every value of column into hashes, one per row
+void fingerprint_column(K column, std::vector<uint64_t>& hashes) {
+    const J rows = static_cast<J>(hashes.size());
+    switch (column->t) {
+        case 0:
+            for (J row = 0; row < rows; ++row) {
+                hashes[row] = fingerprint_fold(hashes[row], fingerprint_object(kK(column)[row]));
+            }
+            return;
+        case KS:
+            for (J row = 0; row < rows; ++row) {
+                hashes[row] = fingerprint_fold(hashes[row], reinterpret_cast<uint64_t>(kS(column)[row]));
+            }
+            return;
+        default: {
+            const int width = fingerprint_width(column->t);
+            const char* data = reinterpret_cast<const char*>(kG(column));
+            if (width <= 0) {
+                return;
+            }
+            for (J row = 0; row < rows; ++row) {
+                hashes[row] = fingerprint_fold(hashes[row], fingerprint_value(data + row * width, column->t, width));
+            }
+            return;
+        }
+    }
+}
+
+// State of a delta serialiser: the plan for the current schema and, for each
+// key seen last time, the fingerprint of its value columns, its row in the
+// last snapshot and the key itself as JSON for when it is deleted. Keys are
+// found by a 64-bit fingerprint of the key columns and confirmed against
+// the key columns of the last snapshot, which are held for that.
+struct DeltaState {
+    struct Row {
+        uint64_t fingerprint;
+        uint64_t generation;
+        J index;  // Row in the snapshot of that generation
+        std::string key;
+    };
+
+    ~DeltaState() { release_keys(); }
+
+    void release_keys() {
+        for (K column : previous_keys) r0(column);
+        previous_keys.clear();
+    }
+
+    SerialisePlan plan;
+    size_t key_columns = 0;
+    uint64_t key_schema = 0;  // Seeds key fingerprints, so new key columns replace every row
+    uint64_t schema = 0;      // Seeds value fingerprints, so new value columns update every row
+    uint64_t generation = 0;
+    std::unordered_multimap<uint64_t, Row> rows;
+    std::vector<K> previous_keys;  // Key columns of the last snapshot, held with r1
+    std::vector<uint64_t> key_hashes;
+    std::vector<uint64_t> value_hashes;
+    std::vector<J> inserted;
+    std::vector<J> updated;
+};
+
+// Recompile the plan for keyed table x if its schema has changed
+inline void update_delta_schema(DeltaState& state, K x) {
+    if (state.schema && match_plan(state.plan, x)) {
+        return;
+    }
+    state.plan = SerialisePlan();
+    compile_plan(state.plan, x);
+    state.key_columns = kK(kK(x)[0]->k)[0]->n;
+    uint64_t schema = FINGERPRINT_K0;
+    for (size_t col = 0; col < state.plan.names.size(); ++col) {
+        if (col == state.key_columns) {
+            state.key_schema = schema;
+        }
+        schema = fingerprint_fold(schema, reinterpret_cast<uint64_t>(state.plan.names[col]));
+        schema = fingerprint_fold(schema, static_cast<uint64_t>(state.plan.types[col]));
+    }
+    if (state.key_columns == state.plan.names.size()) {
+        state.key_schema = schema;
+    }
+    state.schema = schema | 1;
+}
+
+// Write the rows of keyed table x that were inserted, updated or deleted
+// since the last call as {"insert":[...],"update":[...],"delete":[...]},
+// leaving out empty sections. Deleted rows are written as their key columns.
+template<typename Writer>
+void serialise_delta(Writer& w, DeltaState& state, K x) {
+    update_delta_schema(state, x);
+    const SerialisePlan& plan = state.plan;
+    const J count = plan.columns.empty() ? 0 : plan.columns[0]->n;
+
+    state.key_hashes.assign(count, state.key_schema);
+    state.value_hashes.assign(count, state.schema);
+    for (size_t col = 0; col < plan.columns.size(); ++col) {
+        fingerprint_column(plan.columns[col], col < state.key_columns ? state.key_hashes : state.value_hashes);
+    }
+
+    const uint64_t generation = ++state.generation;
+    size_t seen = 0;
+    state.inserted.clear();
+    state.updated.clear();
+
+    // A fingerprint match only counts if the key columns hold the same
+    // values, in this snapshot for keys already seen in it, else in the last
+    auto same_key = [&](const DeltaState::Row& entry, J row) {
+        const bool current = entry.generation == generation;
+        if (!current && state.previous_keys.size() != state.key_columns) {
+            return false;
+        }
+        for (size_t col = 0; col < state.key_columns; ++col) {
+            const K before = current ? plan.columns[col] : state.previous_keys[col];
+            if (!fingerprint_cells_equal(before, entry.index, plan.columns[col], row)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (J row = 0; row < count; ++row) {
+        auto range = state.rows.equal_range(state.key_hashes[row]);
+        auto found = state.rows.end();
+        for (auto it = range.first; it != range.second; ++it) {
+            if (same_key(it->second, row)) {
+                found = it;
+                break;
+            }
+        }
+        if (found == state.rows.end()) {
+            rapidjson::StringBuffer key;
+            JsonWriter key_writer(key);
+            key_writer.SetMaxDecimalPlaces(5);
+            key_writer.StartObject();
+            for (size_t col = 0; col < state.key_columns; ++col) {
+                key_writer.RawValue(plan.keys[col].data(), plan.keys[col].size(), rapidjson::kStringType);
+                plan.kernels[col](key_writer, plan.columns[col], true, row);
+            }
+            key_writer.EndObject();
+            state.rows.emplace(state.key_hashes[row],
+                               DeltaState::Row{state.value_hashes[row], generation, row, std::string(key.GetString(), key.GetSize())});
+            state.inserted.push_back(row);
+            ++seen;
+            continue;
+        }
+        DeltaState::Row& entry = found->second;
+        if (entry.generation != generation) {
+            entry.generation = generation;
+            entry.index = row;
+            ++seen;
+        }
+        if (entry.fingerprint != state.value_hashes[row]) {
+            entry.fingerprint = state.value_hashes[row];
+            state.updated.push_back(row);
+        }
+    }
+
+    w.StartObject();
+    for (const auto& [name, section] : {std::pair<const char*, const std::vector<J>*>{"insert", &state.inserted},
+                                        std::pair<const char*, const std::vector<J>*>{"update", &state.updated}}) {
+        if (section->empty()) {
+            continue;
+        }
+        w.Key(name);
+        w.StartArray();
+        for (J row : *section) {
+            serialise_plan_row(w, plan, row);
+        }
+        w.EndArray();
+    }
+    // Only walk the previous keys when some of them were not seen this time
+    if (seen < state.rows.size()) {
+        w.Key("delete");
+        w.StartArray();
+        for (auto it = state.rows.begin(); it != state.rows.end();) {
+            if (it->second.generation == generation) {
+                ++it;
+                continue;
+            }
+            w.RawValue(it->second.key.data(), it->second.key.size(), rapidjson::kObjectType);
+            it = state.rows.erase(it);
+        }
+        w.EndArray();
+    }
+    w.EndObject();
+
+    // Every remaining entry now points into this snapshot's key columns
+    state.release_keys();
+    for (size_t col = 0; col < state.key_columns; ++col) {
+        state.previous_keys.push_back(r1(plan.columns[col]));
+    }
+}
+
+// Sparse serialisation (ktojo): for each column, what makes a cell left
+// out. Cells are tested as their row is written, so nothing is allocated
+// per cell and a column without a rule costs no more than in ktoj.
+struct OmitRule {
+    bool nulls = false;               // Cells ktoj writes as null, and null symbols
+    const char* fallback = nullptr;   // Bytes of the default value
+    int width = 0;
+};
+
+struct OmitRules {
+    std::vector<OmitRule> columns;
+};
+
+// Whether cell row of column x is one ktoj writes as null, or a null
+// (empty) symbol, which is q's null for the type even though ktoj writes ""
+inline bool null_cell(K x, J row) {
+    switch (x->t) {
+        case KH: return kH(x)[row] == nh || kH(x)[row] == wh;
+        case KI: return kI(x)[row] == ni || kI(x)[row] == wi;
+        case KJ: return kJ(x)[row] == nj || kJ(x)[row] == wj;
+        case KE: return std::isnan(kE(x)[row]);
+        case KF:
+        case KZ: return std::isnan(kF(x)[row]);
+        case KD: case KM: case KU: case KV: case KT: return kI(x)[row] == ni;
+        case KP: case KN: case 20: return kJ(x)[row] == nj;
+        case KS: return !kS(x)[row] || !*kS(x)[row];
+        case UU: {
+            static const U null_guid = {0};
+            return memcmp(&kU(x)[row], &null_guid, sizeof(U)) == 0;
+        }
+        case 0: return kK(x)[row]->t == 101;
+        default: return false;
+    }
+}
+
+// Point rule at element idx of values, the values of the defaults dictionary
+inline const char* default_rule(K x, K values, J idx, OmitRule& rule) {
+    const char* type_error = "Type error: Default values must be atoms of their column's type";
+    const int width = x->t == KS ? static_cast<int>(sizeof(S)) : ipc_width(x->t);
+    if (width <= 0) {
+        return type_error;
+    }
+    if (values->t == 0) {
+        const K atom = kK(values)[idx];
+        if (atom->t != -x->t) {
+            return type_error;
+        }
+        // Guid atoms keep their bytes where a vector's data would be
+        rule.fallback = atom->t == -UU ? reinterpret_cast<const char*>(kG(atom)) : reinterpret_cast<const char*>(&atom->g);
+    } else {
+        if (values->t != x->t) {
+            return type_error;
+        }
+        rule.fallback = reinterpret_cast<const char*>(kG(values)) + idx * width;
+    }
+    rule.width = width;
+    return nullptr;
+}
+
+inline const char* compile_omit_rules(const SerialisePlan& plan, const SerialiseOptions& options, OmitRules& omit) {
+    omit.columns.assign(plan.columns.size(), OmitRule());
+
+    const K names = options.defaults ? kK(options.defaults)[0] : nullptr;
+    if (names) {
+        for (J idx = 0; idx < names->n; ++idx) {
+            if (std::find(plan.names.begin(), plan.names.end(), kS(names)[idx]) == plan.names.end()) {
+                return "Column error: Unknown column";
+            }
+        }
+    }
+
+    for (size_t col = 0; col < omit.columns.size(); ++col) {
+        omit.columns[col].nulls = options.omit_nulls;
+        for (J idx = 0; names && idx < names->n; ++idx) {
+            if (kS(names)[idx] == plan.names[col]) {
+                if (const char* error = default_rule(plan.columns[col], kK(options.defaults)[1], idx, omit.columns[col])) {
+                    return error;
+                }
+            }
+        }
+    }
+    return nullptr;
+}
+
+inline bool omitted(const OmitRule& rule, K x, J row) {
+    if (rule.nulls && null_cell(x, row)) {
+        return true;
+    }
+    // Symbols are interned, so their pointers compare like the other types
+    return rule.fallback && memcmp(reinterpret_cast<const char*>(kG(x)) + row * rule.width, rule.fallback, rule.width) == 0;
+}
+
+template<typename Writer>
+void serialise_sparse_row(Writer& w, const SerialisePlan& plan, const OmitRules& omit, J row) {
+    w.StartObject();
+    for (size_t col = 0; col < plan.columns.size(); ++col) {
+        if (omitted(omit.columns[col], plan.columns[col], row)) {
+            continue;
+        }
+        w.RawValue(plan.keys[col].data(), plan.keys[col].size(), rapidjson::kStringType);
+        plan.kernels[col](w, plan.columns[col], true, row);
+    }
+    w.EndObject();
+}
+
+static HandleTable<SerialisePlan> serialise_plans;
+static HandleTable<DeltaState> delta_serialisers;
+static HandleTable<ParsePlan> parse_plans;
+
+// Incremental parser state: the splitter, the parse options and values
+// converted but not yet returned because a later value failed to parse
+struct JsonStream {
+    StreamSplitter splitter;
+    ParseOptions options;
+    std::vector<K> pending;
+    ~JsonStream() {
+        for (K v : pending) r0(v);
+    }
+};
+
+static HandleTable<JsonStream> json_streams;
+static ResultCache result_cache;
+
+// jtok's values and parse stack are carved from a per-thread arena, so a
+// small message parses without touching the heap. Larger documents spill
+// into chunks that are freed with the document.
+constexpr size_t ARENA_VALUE_BYTES = 65536;
+constexpr size_t ARENA_STACK_BYTES = 16384;
+
+using ArenaDocument = rapidjson::GenericDocument<rapidjson::UTF8<>, rapidjson::MemoryPoolAllocator<>,
+                                                 rapidjson::MemoryPoolAllocator<>>;
+
+static char* parse_arena() {
+    thread_local std::unique_ptr<char[]> arena(new char[ARENA_VALUE_BYTES + ARENA_STACK_BYTES]);
+    return arena.get();
+}
+
+// ktoj keeps its buffer between calls unless a message grew it past this
+constexpr size_t KTOJ_BUFFER_KEEP = 1 << 20;
+
+}  // namespace kjson
+
+extern "C" {
+
+// krr keeps the pointer it is given, so the message is interned. Takes the
+// ParseResult so documents with any allocator convert to it.
+K handle_parse_error(const rapidjson::ParseResult& result) {
+    std::string errMsg = std::string("Parse error: ") + GetParseError_En(result.Code()) +
+                         " at offset " + std::to_string(result.Offset());
+    return krr(ss(const_cast<S>(errMsg.c_str())));
+}
+
+K jtok(K json_string) {
+    if (json_string->t != KC) {
+        return krr(const_cast<S>("Type error: Input must be a char vector (string)"));
+    }
+
+    const bool cached = kjson::result_cache.enabled();
+    if (cached) {
+        K result = kjson::result_cache.find(json_string);
+        if (result) {
+            return result;
+        }
+    }
+
+    char* arena = kjson::parse_arena();
+    rapidjson::MemoryPoolAllocator<> values(arena, kjson::ARENA_VALUE_BYTES);
+    rapidjson::MemoryPoolAllocator<> stack(arena + kjson::ARENA_VALUE_BYTES, kjson::ARENA_STACK_BYTES);
+    kjson::ArenaDocument document(&values, 1024, &stack);
+    document.Parse(reinterpret_cast<const char*>(kC(json_string)), json_string->n);
+
+    if (document.HasParseError()) {
+        return handle_parse_error(document);
+    }
+
+    try {
+        K result = kjson::json_to_kobject(document);
+        if (cached && result && result->t != -128) {
+            kjson::result_cache.insert(json_string, result);
+        }
+        return result;
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K jtokcache(K budget) {
+    if (budget->t != -KJ) {
+        return krr(const_cast<S>("Type error: Budget must be a long"));
+    }
+    kjson::result_cache.set_budget(budget->j);
+    return kjson::result_cache.stats();
+}
+
+K jtokcachestats(K /*x*/) {
+    return kjson::result_cache.stats();
+}
+
+K jtoko(K json_string, K opts) {
+    if (json_string->t != KC) {
+        return krr(const_cast<S>("Type error: Input must be a char vector (string)"));
+    }
+
+    kjson::ParseOptions options;
+    const char* error = kjson::read_parse_options(opts, options);
+    if (error) {
+        return krr(const_cast<S>(error));
+    }
+
+    rapidjson::Document document;
+    document.Parse(reinterpret_cast<const char*>(kC(json_string)), json_string->n);
+
+    if (document.HasParseError()) {
+        return handle_parse_error(document);
+    }
+
+    try {
+        kjson::ParseContext ctx(options);
+        ctx.root = &document;
+        return kjson::json_to_kobject(document, &ctx);
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K jtoipc(K json_string) {
+    if (json_string->t != KC) {
+        return krr(const_cast<S>("Type error: Input must be a char vector (string)"));
+    }
+
+    rapidjson::Document document;
+    document.Parse(reinterpret_cast<const char*>(kC(json_string)), json_string->n);
+
+    if (document.HasParseError()) {
+        return handle_parse_error(document);
+    }
+
+    // Size the message first so the bytes are written straight into the result
+    const size_t size = 8 + kjson::json_to_ipc(document, nullptr);
+    if (size > INT32_MAX) {
+        return krr(const_cast<S>("Limit error: Message exceeds 2GB"));
+    }
+    K bytes = ktn(KG, size);
+    const unsigned char header[4] = {1, 0, 0, 0};  // Little endian, async, uncompressed
+    const int32_t length = static_cast<int32_t>(size);
+    std::memcpy(kG(bytes), header, 4);
+    std::memcpy(kG(bytes) + 4, &length, 4);
+    kjson::json_to_ipc(document, reinterpret_cast<char*>(kG(bytes)) + 8);
+    return bytes;
+}
+
+K jtoks(K opts) {
+    auto stream = std::make_unique<kjson::JsonStream>();
+    const char* error = kjson::read_parse_options(opts, stream->options);
+    if (error) {
+        return krr(const_cast<S>(error));
+    }
+    return kj(kjson::json_streams.add(std::move(stream)));
+}
+
+K jtoksfeed(K handle, K bytes) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    kjson::JsonStream* stream = kjson::json_streams.get(h);
+    if (!stream) {
+        return krr(const_cast<S>("Handle error: Unknown stream handle"));
+    }
+    if (bytes->t != KC && bytes->t != KG) {
+        return krr(const_cast<S>("Type error: Input must be a char or byte vector"));
+    }
+
+    std::vector<std::string_view> values;
+    stream->splitter.feed(reinterpret_cast<const char*>(kG(bytes)), bytes->n, values);
+
+    // Values after a malformed one are still converted; the error is
+    // signalled now and the good values are returned by the next call
+    S error = nullptr;
+    kjson::ParseContext ctx(stream->options);
+    for (const std::string_view& value : values) {
+        rapidjson::Document document;
+        document.Parse(value.data(), value.size());
+
+        if (document.HasParseError()) {
+            if (!error) {
+                std::string msg = std::string("Parse error: ") + GetParseError_En(document.GetParseError()) +
+                                  " at offset " + std::to_string(document.GetErrorOffset());
+                error = ss(const_cast<S>(msg.c_str()));
+            }
+            continue;
+        }
+        try {
+            ctx.root = &document;
+            stream->pending.push_back(kjson::json_to_kobject(document, &ctx));
+        } catch (const std::exception& e) {
+            if (!error) error = ss(const_cast<S>(e.what()));
+        }
+    }
+
+    if (error) {
+        return krr(error);
+    }
+
+    K list = ktn(0, stream->pending.size());
+    for (size_t idx = 0; idx < stream->pending.size(); ++idx) {
+        kK(list)[idx] = stream->pending[idx];
+    }
+    stream->pending.clear();
+    return list;
+}
+
+K jtoksfree(K handle) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    return kb(kjson::json_streams.erase(h));
+}
+
+K jtokprep(K sample) {
+    auto plan = std::make_unique<kjson::ParsePlan>();
+    if (sample->t == KS) {
+        kjson::compile_parse_plan(*plan, sample);
+    } else if (sample->t == KC) {
+        rapidjson::Document document;
+        document.Parse(reinterpret_cast<const char*>(kC(sample)), sample->n);
+
+        if (document.HasParseError()) {
+            return handle_parse_error(document);
+        }
+        if (!kjson::compile_parse_plan(*plan, document)) {
+            return krr(const_cast<S>("Type error: Sample message must be a JSON object"));
+        }
+    } else {
+        return krr(const_cast<S>("Type error: Sample must be a JSON string or a symbol list of keys"));
+    }
+    return kj(kjson::parse_plans.add(std::move(plan)));
+}
+
+K jtokexec(K handle, K json_string) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    const kjson::ParsePlan* plan = kjson::parse_plans.get(h);
+    if (!plan) {
+        return krr(const_cast<S>("Handle error: Unknown parser handle"));
+    }
+    if (json_string->t != KC) {
+        return krr(const_cast<S>("Type error: Input must be a char vector (string)"));
+    }
+
+    // Small messages fit in these buffers, values and parse stack alike, so
+    // parsing does not touch the heap
+    char pool[4096];
+    char stack_pool[1024];
+    rapidjson::MemoryPoolAllocator<> allocator(pool, sizeof(pool));
+    rapidjson::MemoryPoolAllocator<> stack_allocator(stack_pool, sizeof(stack_pool));
+    kjson::ArenaDocument document(&allocator, 256, &stack_allocator);
+    document.Parse(reinterpret_cast<const char*>(kC(json_string)), json_string->n);
+
+    if (document.HasParseError()) {
+        return handle_parse_error(document);
+    }
+
+    try {
+        // Messages that do not match the expected keys take the generic path
+        K result = kjson::json_to_kobject_plan(*plan, document);
+        return result ? result : kjson::json_to_kobject(document);
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K jtokfree(K handle) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    return kb(kjson::parse_plans.erase(h));
+}
+
+K ktoj(K x) {
+    // Reused between calls, so a small message is written without allocating
+    thread_local rapidjson::StringBuffer buffer;
+    thread_local kjson::JsonWriter writer(buffer);
+    buffer.Clear();
+    writer.Reset(buffer);
+
+    writer.SetMaxDecimalPlaces(5);
+
+    K result;
+    try {
+        kjson::serialise_atom(writer, x, -1);
+
+        size_t len = buffer.GetSize();
+        const char* str = buffer.GetString();
+
+        result = kpn(const_cast<S>(str), len);
+    } catch (const std::exception& e) {
+        result = krr(ss(const_cast<S>(e.what())));
+    }
+    if (buffer.GetSize() > kjson::KTOJ_BUFFER_KEEP) {
+        buffer.Clear();
+        buffer.ShrinkToFit();
+    }
+    return result;
+}
+
+K ipctoj(K bytes) {
+    if (bytes->t != KG) {
+        return krr(const_cast<S>("Type error: Input must be a byte vector"));
+    }
+    if (bytes->n < 9) {
+        return krr(const_cast<S>("IPC error: Message is truncated"));
+    }
+    if (kG(bytes)[0] != 1) {
+        return krr(const_cast<S>("IPC error: Only little-endian messages are supported"));
+    }
+
+    const char* message = reinterpret_cast<const char*>(kG(bytes));
+    size_t length = std::min<size_t>(bytes->n, kjson::ipc_load<int32_t>(message + 4));
+    std::vector<char> expanded;
+    if (kG(bytes)[2] == 1) {
+        if (!kjson::ipc_decompress(kG(bytes), bytes->n, expanded)) {
+            return krr(const_cast<S>("IPC error: Malformed compressed message"));
+        }
+        message = expanded.data();
+        length = expanded.size();
+    }
+
+    rapidjson::StringBuffer buffer;
+    kjson::JsonWriter writer(buffer);
+    writer.SetMaxDecimalPlaces(5);
+
+    try {
+        kjson::IpcView view;
+        kjson::IpcReader(message + length).read(message + 8, view);
+        kjson::serialise_ipc(writer, view, -1);
+        return kpn(const_cast<S>(buffer.GetString()), buffer.GetSize());
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K ktojprep(K sample) {
+    auto plan = std::make_unique<kjson::SerialisePlan>();
+    if (!kjson::compile_plan(*plan, sample)) {
+        return krr(const_cast<S>("Type error: Sample must be a table or keyed table"));
+    }
+    return kj(kjson::serialise_plans.add(std::move(plan)));
+}
+
+K ktojexec(K handle, K x) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    kjson::SerialisePlan* plan = kjson::serialise_plans.get(h);
+    if (!plan) {
+        return krr(const_cast<S>("Handle error: Unknown serialiser handle"));
+    }
+
+    rapidjson::StringBuffer buffer;
+    kjson::JsonWriter writer(buffer);
+
+    writer.SetMaxDecimalPlaces(5);
+
+    try {
+        // Tables that do not match the compiled schema take the generic path
+        if (kjson::match_plan(*plan, x)) {
+            kjson::serialise_with_plan(writer, *plan);
+        } else {
+            kjson::serialise_atom(writer, x, -1);
+        }
+        return kpn(const_cast<S>(buffer.GetString()), buffer.GetSize());
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K ktojfree(K handle) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    return kb(kjson::serialise_plans.erase(h));
+}
+
+K ktojrows(K x) {
+    kjson::SerialisePlan plan;
+    if (!kjson::compile_plan(plan, x)) {
+        return krr(const_cast<S>("Type error: Input must be a table or keyed table"));
+    }
+
+    rapidjson::StringBuffer buffer;
+    kjson::JsonWriter writer(buffer);
+
+    writer.SetMaxDecimalPlaces(5);
+
+    try {
+        // Every row is written into one buffer, then cut into char vectors
+        const J rows = plan.columns.empty() ? 0 : plan.columns[0]->n;
+        std::vector<size_t> ends(rows);
+        for (J row = 0; row < rows; ++row) {
+            writer.Reset(buffer);
+            kjson::serialise_plan_row(writer, plan, static_cast<int>(row));
+            ends[row] = buffer.GetSize();
+        }
+
+        K result = ktn(0, rows);
+        const char* json = buffer.GetString();
+        size_t start = 0;
+        for (J row = 0; row < rows; ++row) {
+            kK(result)[row] = kpn(const_cast<S>(json + start), ends[row] - start);
+            start = ends[row];
+        }
+        return result;
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K ktojo(K x, K opts) {
+    kjson::SerialiseOptions options;
+    if (const char* error = kjson::read_serialise_options(opts, options)) {
+        return krr(const_cast<S>(error));
+    }
+    kjson::SerialisePlan plan;
+    if (!kjson::compile_plan(plan, x)) {
+        return krr(const_cast<S>("Type error: Input must be a table or keyed table"));
+    }
+    kjson::OmitRules omit;
+    if (const char* error = kjson::compile_omit_rules(plan, options, omit)) {
+        return krr(const_cast<S>(error));
+    }
+
+    rapidjson::StringBuffer buffer;
+    kjson::JsonWriter writer(buffer);
+
+    writer.SetMaxDecimalPlaces(5);
+
+    try {
+        const J rows = plan.columns.empty() ? 0 : plan.columns[0]->n;
+        writer.StartArray();
+        for (J row = 0; row < rows; ++row) {
+            kjson::serialise_sparse_row(writer, plan, omit, row);
+        }
+        writer.EndArray();
+
+        return kpn(const_cast<S>(buffer.GetString()), buffer.GetSize());
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K ktojdelta(K /*x*/) {
+    return kj(kjson::delta_serialisers.add(std::make_unique<kjson::DeltaState>()));
+}
+
+K ktojdeltaexec(K handle, K x) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    kjson::DeltaState* state = kjson::delta_serialisers.get(h);
+    if (!state) {
+        return krr(const_cast<S>("Handle error: Unknown delta serialiser handle"));
+    }
+    if (x->t != XD || kK(x)[0]->t != XT || kK(x)[1]->t != XT) {
+        return krr(const_cast<S>("Type error: Input must be a keyed table"));
+    }
+
+    rapidjson::StringBuffer buffer;
+    kjson::JsonWriter writer(buffer);
+
+    writer.SetMaxDecimalPlaces(5);
+
+    try {
+        kjson::serialise_delta(writer, *state, x);
+        return kpn(const_cast<S>(buffer.GetString()), buffer.GetSize());
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+K ktojdeltafree(K handle) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    return kb(kjson::delta_serialisers.erase(h));
+}
+
+K hdbtoj(K root, K table, K partitions, K outdir) {
+    if (root->t != -KS || table->t != -KS || outdir->t != -KS) {
+        return krr(const_cast<S>("Type error: HDB root, table and output directory must be symbols"));
+    }
+    if (partitions->t != KD && partitions->t != KM && partitions->t != KI && partitions->t != KJ) {
+        return krr(const_cast<S>("Type error: Partitions must be a date, month or int vector"));
+    }
+
+    const std::string hdb = kjson::strip_handle(root->s);
+    const std::string out = kjson::strip_handle(outdir->s);
+    if (mkdir(out.c_str(), 0755) != 0 && errno != EEXIST) {
+        return krr(ss(const_cast<S>(("File error: Unable to create " + out).c_str())));
+    }
+
+    // The sym file is read once for every partition
+    K domain = k(0, const_cast<S>("get"), ks(const_cast<S>((":" + hdb + "/sym").c_str())), (K)0);
+    if (domain && domain->t != KS) {
+        r0(domain);
+        domain = nullptr;
+    }
+
+    std::vector<kjson::ExportPartition> parts(partitions->n);
+    const char* error = nullptr;
+
+    for (J idx = 0; idx < partitions->n && !error; ++idx) {
+        kjson::ExportPartition& part = parts[idx];
+        kjson::partition_name(partitions, idx, part.name, part.field, part.value);
+
+        // Absent dates in the range (weekends, holidays) are skipped
+        struct stat info;
+        if (stat((hdb + "/" + part.name + "/" + table->s).c_str(), &info) != 0 && errno == ENOENT) {
+            part.missing = true;
+            continue;
+        }
+
+        const std::string dir = ":" + hdb + "/" + part.name + "/" + table->s + "/";
+        K t = k(0, const_cast<S>("get"), ks(const_cast<S>(dir.c_str())), (K)0);
+        if (!t || t->t != XT) {
+            if (t) r0(t);
+            error = ss(const_cast<S>(("File error: Unable to load " + dir).c_str()));
+            break;
+        }
+        part.table = t;
+
+        kjson::compile_plan(part.plan, t);
+        kjson::match_plan(part.plan, t);
+        part.is_nested.assign(part.plan.columns.size(), 0);
+        part.is_enum.assign(part.plan.columns.size(), 0);
+        for (size_t col = 0; col < part.plan.columns.size(); ++col) {
+            K column = part.plan.columns[col];
+            if (column->t >= 20 && column->t < 77) {
+                // Enumeration type numbers are handed out per session, so the
+                // domain is found by name. Only sym is read from the HDB.
+                K name = k(0, const_cast<S>("key"), r1(column), (K)0);
+                const bool sym = name && name->t == -KS && strcmp(name->s, "sym") == 0;
+                if (name) r0(name);
+                if (!sym) {
+                    error = "Type error: Only columns enumerated against sym are supported";
+                    break;
+                }
+                if (!domain) {
+                    error = "File error: Enumerated column but no sym file in HDB root";
+                    break;
+                }
+                part.is_enum[col] = 1;
+                kjson::advise_sequential(column);
+                continue;
+            }
+            if (column->t == 97) {
+                error = "Type error: Only columns enumerated against sym are supported";
+                break;
+            }
+            if (column->t >= 77 && column->t < XT) {
+                part.nested.push_back(col);
+                part.mapped.push_back(column);
+                part.is_nested[col] = 1;
+                part.plan.kernels[col] = kjson::column_kernel<kjson::JsonWriter>(0);
+            } else if (column->t > 0 && column->t < 20) {
+                kjson::advise_sequential(column);
+            }
+        }
+        part.rows = part.plan.columns.empty() ? 0 : part.plan.columns[0]->n;
+    }
+
+    if (!error) {
+        // One worker per partition, up to the number of cores, while this
+        // thread serves their nested column chunks
+        kjson::ExportChunks chunks;
+        std::atomic<size_t> next(0);
+        auto work = [&]() {
+            for (size_t idx; (idx = next++) < parts.size();) {
+                if (parts[idx].missing) continue;
+                kjson::export_partition(parts[idx], out + "/" + parts[idx].name + ".json", domain, chunks);
+            }
+            chunks.finished();
+        };
+        const size_t count = std::min<size_t>(parts.size(), std::max(1u, std::thread::hardware_concurrency()));
+        chunks.active = count;
+        std::vector<std::thread> workers;
+        for (size_t idx = 0; idx < count; ++idx) {
+            workers.emplace_back(work);
+        }
+        chunks.serve();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    K names = ktn(KS, parts.size());
+    K rows = ktn(KJ, parts.size());
+    for (size_t idx = 0; idx < parts.size(); ++idx) {
+        kjson::ExportPartition& part = parts[idx];
+        if (!error && !part.error.empty()) {
+            error = ss(const_cast<S>(part.error.c_str()));
+        }
+        kS(names)[idx] = ss(const_cast<S>(part.name.c_str()));
+        kJ(rows)[idx] = part.missing ? nj : part.error.empty() ? part.rows : 0;
+        part.release_chunk();
+        if (part.table) r0(part.table);
+    }
+    if (domain) r0(domain);
+
+    if (error) {
+        r0(names);
+        r0(rows);
+        return krr(const_cast<S>(error));
+    }
+    return xD(names, rows);
+}
+
+K ktojv(K x, K cols, K rows) {
+    if (x->t != XT) {
+        return krr(const_cast<S>("Type error: Input must be a table"));
+    }
+
+    kjson::SerialisePlan plan;
+    const char* error = kjson::project_plan(plan, x, cols);
+    if (error) {
+        return krr(const_cast<S>(error));
+    }
+
+    rapidjson::StringBuffer buffer;
+    kjson::JsonWriter writer(buffer);
+
+    writer.SetMaxDecimalPlaces(5);
+
+    try {
+        const K values = kK(x->k)[1];
+        const J count = values->n ? kK(values)[0]->n : 0;
+        error = kjson::serialise_plan_rows(writer, plan, count, rows);
+        if (error) {
+            return krr(const_cast<S>(error));
+        }
+        return kpn(const_cast<S>(buffer.GetString()), buffer.GetSize());
     } catch (const std::exception& e) {
-        return krr(const_cast<S>(e.what()));
+        return krr(ss(const_cast<S>(e.what())));
     }
 }
 
@@ -0,0 +1,300 @@
+/* File: kjson_async.cpp */
+
+#include "kjson_serialisation.h"
+#include "kjson_utils.h"
+#include "rapidjson/error/en.h"  // For GetParseError_En
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kjson {
+
+namespace {
+
+// Parsing is bound by memory bandwidth well before it runs out of cores, so
+// a large host does not get one idle thread per core
+constexpr unsigned MAX_ASYNC_WORKERS = 4;
+
+// A payload queued for parsing. Workers only read the input bytes and fill
+// in the document; every K object is created and released on the main thread.
+struct AsyncJob {
+    J id = 0;
+    K input = nullptr;     // Char vector held with r1 until delivery
+    std::string path;      // File to read when there is no input vector
+    K callback = nullptr;
+    J bytes = 0;
+    std::string contents;  // File contents read by the worker
+    rapidjson::Document document;
+    std::string error;
+};
+
+class AsyncParser {
+public:
+    ~AsyncParser() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    // Queue a job, or leave it with the caller and return an error message
+    // if a limit would be exceeded
+    const char* submit(std::unique_ptr<AsyncJob>& job) {
+        if (!start()) {
+            return "Async error: Unable to create eventfd";
+        }
+        if (queued_ >= max_queue_ || in_flight_bytes_ + job->bytes > max_bytes_) {
+            ++rejected_;
+            return "Limit error: Async queue depth or in-flight bytes exceeded";
+        }
+
+        ++queued_;
+        ++submitted_;
+        in_flight_bytes_ += job->bytes;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+        return nullptr;
+    }
+
+    J next_id() { return next_id_++; }
+
+    void set_limits(J max_queue, J max_bytes) {
+        max_queue_ = max_queue;
+        max_bytes_ = max_bytes;
+    }
+
+    // Counters, then the message of the last callback that signalled
+    K stats() const {
+        const char* names[] = {"queued", "inflightbytes", "submitted", "completed", "failed",
+                               "rejected", "maxqueue", "maxbytes", "workers", "callbackerrors", "lasterror"};
+        const J counters[] = {queued_, in_flight_bytes_, submitted_, completed_, failed_,
+                              rejected_, max_queue_, max_bytes_, static_cast<J>(workers_.size()), callback_errors_};
+        const int count = sizeof(names) / sizeof(names[0]);
+        K keys = ktn(KS, count);
+        K values = ktn(0, count);
+        for (int idx = 0; idx < count; ++idx) {
+            kS(keys)[idx] = ss(const_cast<S>(names[idx]));
+            kK(values)[idx] = idx < count - 1 ? kj(counters[idx]) : kp(const_cast<S>(last_error_.c_str()));
+        }
+        return xD(keys, values);
+    }
+
+    // Called from the q main loop when workers have signalled the eventfd
+    void deliver() {
+        uint64_t signalled;
+        if (read(fd_, &signalled, sizeof(signalled)) < 0) {
+            // Nothing pending, another wakeup already drained the queue
+        }
+
+        std::deque<std::unique_ptr<AsyncJob>> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done.swap(done_);
+        }
+
+        for (std::unique_ptr<AsyncJob>& job : done) {
+            K result = nullptr;
+            bool ok = job->error.empty();
+            if (ok) {
+                try {
+                    result = json_to_kobject(job->document);
+                } catch (const std::exception& e) {
+                    ok = false;
+                    job->error = e.what();
+                }
+            }
+            if (!ok) {
+                result = kp(const_cast<S>(job->error.c_str()));
+            }
+            ok ? ++completed_ : ++failed_;
+
+            // Release the payload before running the callback
+            if (job->input) r0(job->input);
+            --queued_;
+            in_flight_bytes_ -= job->bytes;
+
+            K r = k(0, const_cast<S>("."), job->callback, knk(3, kj(job->id), kb(ok), result), (K)0);
+            if (r && r->t == -128) {
+                ++callback_errors_;
+                last_error_ = r->s;
+            }
+            if (r) r0(r);
+        }
+    }
+
+private:
+    bool start() {
+        if (fd_ >= 0) {
+            return true;
+        }
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd_ < 0) {
+            return false;
+        }
+        sd1(fd_, on_ready);
+
+        const unsigned count = std::clamp(std::thread::hardware_concurrency(), 1u, MAX_ASYNC_WORKERS);
+        for (unsigned idx = 0; idx < count; ++idx) {
+            workers_.emplace_back([this] { work(); });
+        }
+        return true;
+    }
+
+    void work() {
+        for (;;) {
+            std::unique_ptr<AsyncJob> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                job = std::move(pending_.front());
+                pending_.pop_front();
+            }
+
+            parse(*job);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.push_back(std::move(job));
+            }
+            const uint64_t one = 1;
+            if (write(fd_, &one, sizeof(one)) < 0) {
+                // The counter only saturates if the main loop never drains it
+            }
+        }
+    }
+
+    static void parse(AsyncJob& job) {
+        const char* data;
+        size_t size;
+        if (job.input) {
+            data = reinterpret_cast<const char*>(kC(job.input));
+            size = job.input->n;
+        } else {
+            FILE* file = fopen(job.path.c_str(), "rb");
+            if (!file) {
+                job.error = "File error: Unable to open " + job.path;
+                return;
+            }
+            char chunk[65536];
+            size_t read;
+            while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+                job.contents.append(chunk, read);
+            }
+            fclose(file);
+            data = job.contents.data();
+            size = job.contents.size();
+        }
+
+        job.document.Parse(data, size);
+        if (job.document.HasParseError()) {
+            job.error = std::string("Parse error: ") + rapidjson::GetParseError_En(job.document.GetParseError()) +
+                        " at offset " + std::to_string(job.document.GetErrorOffset());
+        }
+        std::string().swap(job.contents);
+    }
+
+    static K on_ready(I fd);
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<AsyncJob>> pending_;
+    std::deque<std::unique_ptr<AsyncJob>> done_;
+    std::vector<std::thread> workers_;
+    bool stopping_ = false;
+    int fd_ = -1;
+
+    // Limits and counters, only touched on the main thread
+    J max_queue_ = 1024;
+    J max_bytes_ = 1LL << 30;
+    J queued_ = 0;
+    J in_flight_bytes_ = 0;
+    J submitted_ = 0;
+    J completed_ = 0;
+    J failed_ = 0;
+    J rejected_ = 0;
+    J callback_errors_ = 0;
+    std::string last_error_;
+    J next_id_ = 1;
+};
+
+AsyncParser async_parser;
+
+K AsyncParser::on_ready(I /*fd*/) {
+    async_parser.deliver();
+    return (K)0;
+}
+
+}  // namespace
+
+}  // namespace kjson
+
+extern "C" {
+
+K jtokasync(K x, K callback) {
+    auto job = std::make_unique<kjson::AsyncJob>();
+
+    if (x->t == KC) {
+        job->input = x;
+        job->bytes = x->n;
+    } else if (x->t == -KS) {
+        // File handles such as `:data.json are read by the worker
+        job->path = x->s[0] == ':' ? x->s + 1 : x->s;
+        FILE* file = fopen(job->path.c_str(), "rb");
+        if (!file) {
+            return krr(const_cast<S>("File error: Unable to open file"));
+        }
+        fseek(file, 0, SEEK_END);
+        job->bytes = ftell(file);
+        fclose(file);
+    } else {
+        return krr(const_cast<S>("Type error: Input must be a char vector (string) or a file symbol"));
+    }
+
+    job->id = kjson::async_parser.next_id();
+    job->callback = callback;
+    const J id = job->id;
+
+    // Hold the payload and callback until delivery; the worker never touches
+    // reference counts
+    if (job->input) r1(job->input);
+    r1(callback);
+
+    const char* error = kjson::async_parser.submit(job);
+    if (error) {
+        if (job->input) r0(job->input);
+        r0(callback);
+        return krr(const_cast<S>(error));
+    }
+    return kj(id);
+}
+
+K jtokasynclimits(K max_queue, K max_bytes) {
+    if (max_queue->t != -KJ || max_bytes->t != -KJ) {
+        return krr(const_cast<S>("Type error: Limits must be longs"));
+    }
+    kjson::async_parser.set_limits(max_queue->j, max_bytes->j);
+    return kjson::async_parser.stats();
+}
+
+K jtokasyncstats(K /*x*/) {
+    return kjson::async_parser.stats();
+}
+
+}  // extern "C"
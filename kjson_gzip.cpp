@@ -0,0 +1,258 @@
+/* File: kjson_gzip.cpp */
+
+#include "kjson_serialisation.h"
+#include "kjson_utils.h"
+#include "rapidjson/error/en.h"  // For GetParseError_En
+#include <zlib.h>
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kjson {
+
+namespace {
+
+constexpr size_t INFLATE_CHUNK = 65536;
+constexpr size_t INFLATE_SLOTS = 4;
+
+// Inflates gzip or zlib data on a worker thread into a ring of fixed-size
+// chunks and presents the result to RapidJSON as an input stream, so the
+// inflated text is never held whole and decompression overlaps parsing. The
+// parsed DOM, with its strings copied, is still built in full before the K
+// object. The worker blocks while every chunk is waiting to be parsed.
+class InflateStream {
+public:
+    typedef char Ch;
+
+    // Compressed bytes already in memory
+    InflateStream(const Bytef* data, size_t size) : data_(data), size_(size) {}
+
+    // Compressed file, read INFLATE_CHUNK bytes at a time
+    explicit InflateStream(FILE* file) : file_(file) {}
+
+    ~InflateStream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cancelled_ = true;
+        }
+        cv_.notify_all();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+    }
+
+    void start() {
+        worker_ = std::thread([this] { inflate_all(); });
+    }
+
+    // Message from zlib or the file read, or empty
+    std::string error() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return error_;
+    }
+
+    // RapidJSON input stream concept; '\0' marks the end of input
+    Ch Peek() {
+        return cur_ < end_ || next() ? *cur_ : '\0';
+    }
+    Ch Take() {
+        return cur_ < end_ || next() ? (++consumed_, *cur_++) : '\0';
+    }
+    size_t Tell() const { return consumed_; }
+
+    Ch* PutBegin() { RAPIDJSON_ASSERT(false); return nullptr; }
+    void Put(Ch) { RAPIDJSON_ASSERT(false); }
+    void Flush() { RAPIDJSON_ASSERT(false); }
+    size_t PutEnd(Ch*) { RAPIDJSON_ASSERT(false); return 0; }
+
+private:
+    // Hand the parsed chunk back to the worker and wait for the next one
+    bool next() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (cur_) {
+            read_ = (read_ + 1) % INFLATE_SLOTS;
+            --filled_;
+            cv_.notify_all();
+        }
+        cur_ = end_ = nullptr;
+        cv_.wait(lock, [this] { return filled_ > 0 || finished_; });
+        if (filled_ == 0) {
+            return false;
+        }
+        cur_ = slot(read_);
+        end_ = cur_ + sizes_[read_];
+        return true;
+    }
+
+    // Called by the worker with a full (or final) slot
+    bool publish(size_t size) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        sizes_[write_] = size;
+        write_ = (write_ + 1) % INFLATE_SLOTS;
+        ++filled_;
+        cv_.notify_all();
+        cv_.wait(lock, [this] { return filled_ < INFLATE_SLOTS || cancelled_; });
+        return !cancelled_;
+    }
+
+    void finish(const std::string& error) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = error;
+        finished_ = true;
+        cv_.notify_all();
+    }
+
+    void inflate_all() {
+        z_stream zs = {};
+        // 15 window bits plus 32 detects a gzip or zlib header
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+            return finish("Zlib error: Unable to initialise inflate");
+        }
+        std::string error;
+        std::vector<Bytef> input(file_ ? INFLATE_CHUNK : 0);
+        size_t offset = 0;    // Compressed bytes of data_ handed to zlib
+        bool at_end = false;  // All compressed input has been handed to zlib
+        bool stream_end = false;
+        bool cancelled = false;  // The parser stopped reading
+
+        zs.next_out = reinterpret_cast<Bytef*>(slot(write_));
+        zs.avail_out = INFLATE_CHUNK;
+
+        for (;;) {
+            if (zs.avail_in == 0 && !at_end) {
+                if (file_) {
+                    const size_t read = fread(input.data(), 1, input.size(), file_);
+                    if (ferror(file_)) {
+                        error = "File error: Unable to read compressed input";
+                        break;
+                    }
+                    zs.next_in = input.data();
+                    zs.avail_in = static_cast<uInt>(read);
+                } else {
+                    // avail_in is 32 bits, so large vectors are handed over in pieces
+                    const size_t piece = std::min<size_t>(size_ - offset, UINT_MAX);
+                    zs.next_in = const_cast<Bytef*>(data_ + offset);
+                    zs.avail_in = static_cast<uInt>(piece);
+                    offset += piece;
+                }
+                at_end = zs.avail_in == 0;
+            }
+            if (stream_end) {
+                if (zs.avail_in == 0 && at_end) {
+                    break;
+                }
+                // Concatenated gzip members, as written by appending to a .gz file
+                inflateReset(&zs);
+                stream_end = false;
+            }
+
+            const int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                stream_end = true;
+            } else if (ret == Z_BUF_ERROR && zs.avail_in == 0 && at_end) {
+                error = "Zlib error: Compressed input is truncated";
+                break;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                error = std::string("Zlib error: ") + (zs.msg ? zs.msg : "Invalid compressed input");
+                break;
+            }
+
+            if (zs.avail_out == 0) {
+                if (!publish(INFLATE_CHUNK)) {
+                    cancelled = true;
+                    break;
+                }
+                zs.next_out = reinterpret_cast<Bytef*>(slot(write_));
+                zs.avail_out = INFLATE_CHUNK;
+            }
+        }
+
+        const size_t tail = INFLATE_CHUNK - zs.avail_out;
+        if (tail > 0 && error.empty() && !cancelled) {
+            publish(tail);
+        }
+        inflateEnd(&zs);
+        finish(error);
+    }
+
+    char* slot(size_t i) { return buffer_.data() + i * INFLATE_CHUNK; }
+
+    const Bytef* data_ = nullptr;
+    size_t size_ = 0;
+    FILE* file_ = nullptr;
+
+    // Parser side, touched only by the calling thread
+    const char* cur_ = nullptr;
+    const char* end_ = nullptr;
+    size_t consumed_ = 0;
+
+    std::vector<char> buffer_ = std::vector<char>(INFLATE_SLOTS * INFLATE_CHUNK);
+    std::array<size_t, INFLATE_SLOTS> sizes_ = {};
+    size_t read_ = 0;    // Slot being parsed
+    size_t write_ = 0;   // Slot being inflated into
+    size_t filled_ = 0;  // Slots waiting for or being parsed
+    bool finished_ = false;
+    bool cancelled_ = false;
+    std::string error_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread worker_;
+};
+
+K parse_inflated(InflateStream& stream) {
+    stream.start();
+    rapidjson::Document document;
+    document.ParseStream(stream);
+    // A truncated or corrupt input usually shows up as a parse error too, but
+    // the zlib message says what actually went wrong
+    const std::string error = stream.error();
+    if (!error.empty()) {
+        return krr(ss(const_cast<S>(error.c_str())));
+    }
+    if (document.HasParseError()) {
+        const std::string msg = std::string("Parse error: ") + rapidjson::GetParseError_En(document.GetParseError()) +
+                                " at offset " + std::to_string(document.GetErrorOffset());
+        return krr(ss(const_cast<S>(msg.c_str())));
+    }
+    try {
+        return json_to_kobject(document);
+    } catch (const std::exception& e) {
+        return krr(ss(const_cast<S>(e.what())));
+    }
+}
+
+}  // namespace
+
+}  // namespace kjson
+
+extern "C" {
+
+K jtokz(K x) {
+    if (x->t == KG) {
+        kjson::InflateStream stream(kG(x), x->n);
+        return kjson::parse_inflated(stream);
+    }
+    if (x->t != -KS) {
+        return krr(const_cast<S>("Type error: Input must be a byte vector or a file symbol"));
+    }
+    const std::string path = x->s[0] == ':' ? x->s + 1 : x->s;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return krr(ss(const_cast<S>(("File error: Unable to open " + path).c_str())));
+    }
+    K result;
+    {
+        kjson::InflateStream stream(file);
+        result = kjson::parse_inflated(stream);
+    }
+    fclose(file);
+    return result;
+}
+
+}  // extern "C"
@@ -0,0 +1,445 @@
+/* File: kjson_insert.cpp */
+
+#include "kjson_serialisation.h"
+#include "kjson_utils.h"
+#include "rapidjson/error/en.h"  // For GetParseError_En
+#include "rapidjson/memorystream.h"
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace kjson {
+
+namespace {
+
+// Fixed-width decimal field, advancing p
+bool read_digits(const char*& p, const char* end, int width, int& out) {
+    if (end - p < width) {
+        return false;
+    }
+    out = 0;
+    for (int idx = 0; idx < width; ++idx, ++p) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        out = out * 10 + (*p - '0');
+    }
+    return true;
+}
+
+bool read_char(const char*& p, const char* end, const char* accepted) {
+    if (p == end || !strchr(accepted, *p)) {
+        return false;
+    }
+    ++p;
+    return true;
+}
+
+// Days from 2000.01.01 to a civil date (proleptic Gregorian)
+J days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    const J era = (y >= 0 ? y : y - 399) / 400;
+    const J yoe = y - era * 400;
+    const J doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const J doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468 - 10957;
+}
+
+// YYYY-MM-DD, as ktoj writes dates; q's YYYY.MM.DD is accepted too
+bool read_date(const char*& p, const char* end, J& days) {
+    int y, m, d;
+    if (!read_digits(p, end, 4, y) || !read_char(p, end, "-.") || !read_digits(p, end, 2, m) ||
+        !read_char(p, end, "-.") || !read_digits(p, end, 2, d) || m < 1 || m > 12 || d < 1 || d > 31) {
+        return false;
+    }
+    days = days_from_civil(y, m, d);
+    return true;
+}
+
+// HH:MM[:SS[.fraction]] as nanoseconds, with fraction digits up to 9
+bool read_clock(const char*& p, const char* end, J& nanos, bool need_seconds) {
+    int h, m, s = 0;
+    if (!read_digits(p, end, 2, h) || !read_char(p, end, ":") || !read_digits(p, end, 2, m)) {
+        return false;
+    }
+    if (p != end && *p == ':') {
+        ++p;
+        if (!read_digits(p, end, 2, s)) {
+            return false;
+        }
+    } else if (need_seconds) {
+        return false;
+    }
+    J fraction = 0;
+    if (p != end && *p == '.') {
+        ++p;
+        int digits = 0;
+        for (; p != end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            if (digits < 9) {
+                fraction = fraction * 10 + (*p - '0');
+            }
+        }
+        for (; digits < 9; ++digits) {
+            fraction *= 10;
+        }
+    }
+    nanos = ((h * 60LL + m) * 60 + s) * 1000000000LL + fraction;
+    return true;
+}
+
+// Date and time joined by T, D or a space, with an optional trailing Z
+bool read_timestamp(const char*& p, const char* end, J& nanos) {
+    J days, clock = 0;
+    if (!read_date(p, end, days)) {
+        return false;
+    }
+    if (p != end && strchr("TD ", *p)) {
+        ++p;
+        if (!read_clock(p, end, clock, false)) {
+            return false;
+        }
+    }
+    if (p != end && *p == 'Z') {
+        ++p;
+    }
+    nanos = days * 86400000000000LL + clock;
+    return true;
+}
+
+// [-][nD]HH:MM:SS[.fraction], as ktoj writes timespans
+bool read_timespan(const char*& p, const char* end, J& nanos) {
+    const bool negative = p != end && *p == '-';
+    if (negative) {
+        ++p;
+    }
+    J days = 0;
+    const char* d = static_cast<const char*>(memchr(p, 'D', end - p));
+    if (d) {
+        for (; p != d; ++p) {
+            if (*p < '0' || *p > '9') {
+                return false;
+            }
+            days = days * 10 + (*p - '0');
+        }
+        ++p;
+    }
+    J clock;
+    if (!read_clock(p, end, clock, false)) {
+        return false;
+    }
+    nanos = days * 86400000000000LL + clock;
+    if (negative) {
+        nanos = -nanos;
+    }
+    return true;
+}
+
+bool read_guid(const char*& p, const char* end, U& guid) {
+    int idx = 0;
+    for (; p != end && idx < 32; ++p) {
+        if (*p == '-') {
+            continue;
+        }
+        int nibble;
+        if (*p >= '0' && *p <= '9') nibble = *p - '0';
+        else if (*p >= 'a' && *p <= 'f') nibble = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F') nibble = *p - 'A' + 10;
+        else return false;
+        guid.g[idx / 2] = static_cast<G>(idx % 2 ? (guid.g[idx / 2] | nibble) : nibble << 4);
+        ++idx;
+    }
+    return idx == 32;
+}
+
+// Parse a string for a temporal or guid column. The whole string must be
+// consumed.
+bool read_typed_string(signed char t, const rapidjson::Value& v, J& out, F& fout, U& guid) {
+    const char* p = v.GetString();
+    const char* end = p + v.GetStringLength();
+    J value;
+    bool ok;
+    switch (t) {
+        case KP: ok = read_timestamp(p, end, out); break;
+        case KD: ok = read_date(p, end, out); break;
+        case KZ:
+            ok = read_timestamp(p, end, value);
+            if (ok) fout = static_cast<F>(value) / 86400000000000.0;
+            break;
+        case KM: {
+            int y, m;
+            ok = read_digits(p, end, 4, y) && read_char(p, end, "-.") && read_digits(p, end, 2, m) && m >= 1 && m <= 12;
+            if (ok) out = (y - 2000) * 12LL + m - 1;
+            break;
+        }
+        case KN: ok = read_timespan(p, end, out); break;
+        case KT: ok = read_clock(p, end, value, true); if (ok) out = value / 1000000; break;
+        case KU: ok = read_clock(p, end, value, false); if (ok) out = value / 60000000000LL; break;
+        case KV: ok = read_clock(p, end, value, true); if (ok) out = value / 1000000000LL; break;
+        case UU: ok = read_guid(p, end, guid); break;
+        default: ok = false; break;
+    }
+    return ok && p == end;
+}
+
+// Integral value of a number or boolean, rounded as q's casts round
+bool read_integral(const rapidjson::Value& v, J& out) {
+    if (v.IsInt64()) {
+        out = v.GetInt64();
+    } else if (v.IsNumber()) {
+        const F f = v.GetDouble();
+        if (std::isnan(f)) {
+            return false;
+        }
+        out = std::llround(f);
+    } else if (v.IsBool()) {
+        out = v.GetBool();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Append v to column, converted to the column's type. Nulls become the
+// type's null. Returns false if v cannot be converted.
+bool append_value(K& column, const rapidjson::Value& v) {
+    const signed char t = column->t;
+    J j = 0;
+    F f = nf;
+    U guid = {};
+
+    switch (t) {
+        case 0: {
+            K x = v.IsString() ? kpn(const_cast<S>(v.GetString()), v.GetStringLength()) : json_to_kobject(v);
+            if (!x) {
+                return false;
+            }
+            jk(&column, x);
+            return true;
+        }
+        case KS: {
+            if (!v.IsString() && !v.IsNull()) {
+                return false;
+            }
+            js(&column, v.IsNull() ? ss(const_cast<S>("")) : sn(const_cast<S>(v.GetString()), v.GetStringLength()));
+            return true;
+        }
+        case KC: {
+            if (!v.IsString() && !v.IsNull()) {
+                return false;
+            }
+            C c = v.IsString() && v.GetStringLength() ? v.GetString()[0] : ' ';
+            ja(&column, &c);
+            return true;
+        }
+        case KE:
+        case KF:
+        case KZ:
+            if (v.IsNumber()) {
+                f = v.GetDouble();
+            } else if (v.IsBool()) {
+                f = v.GetBool();
+            } else if (v.IsString() && t == KZ) {
+                if (!read_typed_string(t, v, j, f, guid)) return false;
+            } else if (!v.IsNull()) {
+                return false;
+            }
+            if (t == KE) {
+                E e = static_cast<E>(f);
+                ja(&column, &e);
+            } else {
+                ja(&column, &f);
+            }
+            return true;
+        case UU:
+            if (v.IsString() ? !read_typed_string(t, v, j, f, guid) : !v.IsNull()) {
+                return false;
+            }
+            ja(&column, &guid);
+            return true;
+        case KB: case KG: case KH: case KI: case KJ:
+        case KP: case KM: case KD: case KN: case KU: case KV: case KT:
+            break;
+        default:
+            return false;
+    }
+
+    // Integral types, temporal ones counted in their own units from 2000.01.01
+    const bool is_null = v.IsNull();
+    if (is_null) {
+        j = t == KJ || t == KP || t == KN ? nj : ni;
+    } else if (v.IsString()) {
+        if (t <= KJ || !read_typed_string(t, v, j, f, guid)) {
+            return false;
+        }
+    } else if (!read_integral(v, j)) {
+        return false;
+    }
+    switch (t) {
+        case KB: case KG: {
+            G g = static_cast<G>(is_null ? 0 : t == KB ? j != 0 : j);
+            ja(&column, &g);
+            break;
+        }
+        case KH: {
+            H h = is_null ? nh : static_cast<H>(j);
+            ja(&column, &h);
+            break;
+        }
+        case KJ: case KP: case KN:
+            ja(&column, &j);
+            break;
+        default: {
+            I i = static_cast<I>(j);
+            ja(&column, &i);
+            break;
+        }
+    }
+    return true;
+}
+
+// Target table schema and the columns of rows parsed for it
+struct InsertColumns {
+    std::vector<S> names;
+    std::unordered_map<std::string_view, size_t> index;
+    std::vector<K> columns;
+    std::vector<J> filled;  // Row count at which each column was last appended to
+    J rows = 0;
+
+    ~InsertColumns() {
+        for (K column : columns) {
+            r0(column);
+        }
+    }
+
+    void add_part(K part) {
+        const K keys = kK(part->k)[0];
+        const K values = kK(part->k)[1];
+        for (J col = 0; col < keys->n; ++col) {
+            index.emplace(kS(keys)[col], names.size());
+            names.push_back(kS(keys)[col]);
+            columns.push_back(ktn(kK(values)[col]->t, 0));
+            filled.push_back(0);
+        }
+    }
+
+    // Append the fields of object as a row, skipping fields the table does
+    // not have and filling columns the object does not have with nulls
+    const char* add_row(const rapidjson::Value& object) {
+        if (!object.IsObject()) {
+            return "Type error: Rows must be JSON objects";
+        }
+        for (rapidjson::Value::ConstMemberIterator itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr) {
+            auto found = index.find(std::string_view(itr->name.GetString(), itr->name.GetStringLength()));
+            if (found == index.end() || filled[found->second] > rows) {
+                continue;  // Unknown or repeated field
+            }
+            if (!append_value(columns[found->second], itr->value)) {
+                return "Type error: JSON value does not match the column type";
+            }
+            ++filled[found->second];
+        }
+        static const rapidjson::Value null_value;
+        ++rows;
+        for (size_t col = 0; col < columns.size(); ++col) {
+            if (filled[col] < rows) {
+                if (!append_value(columns[col], null_value)) {
+                    return "Type error: Column type is not supported";
+                }
+                ++filled[col];
+            }
+        }
+        return nullptr;
+    }
+
+    const char* add_document(const rapidjson::Value& document) {
+        if (!document.IsArray()) {
+            return add_row(document);
+        }
+        for (rapidjson::Value::ConstValueIterator elem = document.Begin(); elem != document.End(); ++elem) {
+            if (const char* error = add_row(*elem)) {
+                return error;
+            }
+        }
+        return nullptr;
+    }
+};
+
+}  // namespace
+
+}  // namespace kjson
+
+extern "C" {
+
+K jtoins(K table, K json) {
+    if (table->t != -KS) {
+        return krr(const_cast<S>("Type error: Table must be a symbol"));
+    }
+    if (json->t != KC && json->t != KG) {
+        return krr(const_cast<S>("Type error: Input must be a char or byte vector"));
+    }
+
+    K target = k(0, const_cast<S>("value"), ks(table->s), (K)0);
+    K parts[2];
+    const int nparts = target ? kjson::table_parts(target, parts) : 0;
+    if (nparts == 0) {
+        if (target) r0(target);
+        return krr(const_cast<S>("Type error: Target must be the name of a table or keyed table"));
+    }
+
+    kjson::InsertColumns columns;
+    for (int p = 0; p < nparts; ++p) {
+        columns.add_part(parts[p]);
+    }
+    r0(target);
+
+    // One object, one array of objects, or several of either separated by
+    // whitespace as in NDJSON
+    const char* data = reinterpret_cast<const char*>(kG(json));
+    const size_t size = json->n;
+    size_t pos = 0;
+    rapidjson::Document document;
+    for (;;) {
+        while (pos < size && (data[pos] == ' ' || data[pos] == '\n' || data[pos] == '\r' || data[pos] == '\t')) {
+            ++pos;
+        }
+        if (pos == size) {
+            break;
+        }
+        rapidjson::MemoryStream stream(data + pos, size - pos);
+        document.ParseStream<rapidjson::kParseStopWhenDoneFlag>(stream);
+        if (document.HasParseError()) {
+            const std::string msg = std::string("Parse error: ") + rapidjson::GetParseError_En(document.GetParseError()) +
+                                    " at offset " + std::to_string(pos + document.GetErrorOffset());
+            return krr(ss(const_cast<S>(msg.c_str())));
+        }
+        try {
+            if (const char* error = columns.add_document(document)) {
+                return krr(const_cast<S>(error));
+            }
+        } catch (const std::exception& e) {
+            return krr(ss(const_cast<S>(e.what())));
+        }
+        pos += stream.Tell();
+    }
+
+    // insert appends each column to the table's vectors
+    K list = ktn(0, columns.columns.size());
+    for (size_t col = 0; col < columns.columns.size(); ++col) {
+        kK(list)[col] = columns.columns[col];
+    }
+    columns.columns.clear();
+    K result = k(0, const_cast<S>("insert"), ks(table->s), list, (K)0);
+    if (result && result->t == -128) {
+        // Forward q's own error, e.g. 'insert when a key is already in a keyed table.
+        // Enumerated columns never get here: append_value rejects them
+        S msg = ss(result->s);
+        r0(result);
+        return krr(msg);
+    }
+    return result;
+}
+
+}  // extern "C"
@@ -0,0 +1,785 @@
+/* File: kjson_msgpack.cpp */
+
+#include "kjson_serialisation.h"
+#include "kjson_utils.h"
+#include <cstring>  // For memcpy
+#include <string>
+#include <vector>
+
+// MessagePack mapping of K objects, chosen so that mtok ktom x ~ x:
+//   (::)                 nil
+//   boolean atom         true / false
+//   long atom            int
+//   float / real atom    float 64 / float 32
+//   timestamp atom       timestamp extension (-1)
+//   other atoms          ext 0x40|t, big-endian value (symbols as raw bytes)
+//   char vector          str
+//   byte vector          bin
+//   other vectors        ext t, big-endian elements (symbols NUL-terminated)
+//   general list         array
+//   symbol-keyed dict    map, values collapsed with vk like json_to_kobject
+//   other dict           ext 99 holding [keys, values]
+//   table                ext 98 holding a map of columns
+// Enumerations are resolved against `sym, as in ktoj.
+//
+// The encoder has its own type switch rather than reusing serialise_atom's:
+// that dispatch emits the JSON form of each type (dates and times as
+// strings, nulls as null, guids as text), which would lose the K types this
+// mapping has to carry for mtok to rebuild them.
+
+namespace kjson {
+
+namespace {
+
+constexpr int8_t EXT_TIMESTAMP = -1;
+constexpr int8_t EXT_ATOM = 0x40;
+constexpr int8_t EXT_TABLE = XT;
+constexpr int8_t EXT_DICT = XD;
+constexpr long long NANOS_IN_SEC = 1000000000LL;
+constexpr long long SECS_1970_TO_2000 = 946684800LL;
+
+inline uint8_t swap_bytes(uint8_t v) { return v; }
+inline uint16_t swap_bytes(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t swap_bytes(uint32_t v) { return __builtin_bswap32(v); }
+inline uint64_t swap_bytes(uint64_t v) { return __builtin_bswap64(v); }
+
+// Big-endian value at data, whose length the caller has checked
+template<typename T>
+T load_big_endian(const G* data) {
+    T v;
+    memcpy(&v, data, sizeof(T));
+    return swap_bytes(v);
+}
+
+// Width in bytes of the elements of a vector of type t, 0 if not fixed
+int item_width(int t) {
+    switch (t) {
+        case KB: case KG: case KC:
+            return 1;
+        case KH:
+            return 2;
+        case KI: case KE: case KM: case KD: case KU: case KV: case KT:
+            return 4;
+        case KJ: case KF: case KP: case KN: case KZ:
+            return 8;
+        case UU:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+class Packer {
+public:
+    std::string out;
+
+    void byte(uint8_t b) { out.push_back(static_cast<char>(b)); }
+
+    template<typename T>
+    void big_endian(T v) {
+        v = swap_bytes(v);
+        out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    // Copy a vector as one block of big-endian elements
+    template<typename T>
+    void big_endian_block(const G* data, J n) {
+        const size_t start = out.size();
+        out.resize(start + n * sizeof(T));
+        char* dst = &out[start];
+        for (J idx = 0; idx < n; ++idx) {
+            T v;
+            memcpy(&v, data + idx * sizeof(T), sizeof(T));
+            v = swap_bytes(v);
+            memcpy(dst + idx * sizeof(T), &v, sizeof(T));
+        }
+    }
+
+    void nil() { byte(0xc0); }
+
+    void boolean(bool b) { byte(b ? 0xc3 : 0xc2); }
+
+    void integer(J n) {
+        if (n >= 0 && n <= 0x7f) {
+            byte(static_cast<uint8_t>(n));
+        } else if (n >= -32 && n < 0) {
+            byte(static_cast<uint8_t>(n));
+        } else if (n >= INT8_MIN && n <= INT8_MAX) {
+            byte(0xd0);
+            byte(static_cast<uint8_t>(n));
+        } else if (n >= INT16_MIN && n <= INT16_MAX) {
+            byte(0xd1);
+            big_endian(static_cast<uint16_t>(n));
+        } else if (n >= INT32_MIN && n <= INT32_MAX) {
+            byte(0xd2);
+            big_endian(static_cast<uint32_t>(n));
+        } else {
+            byte(0xd3);
+            big_endian(static_cast<uint64_t>(n));
+        }
+    }
+
+    void float32(E e) {
+        uint32_t bits;
+        memcpy(&bits, &e, sizeof(bits));
+        byte(0xca);
+        big_endian(bits);
+    }
+
+    void float64(F f) {
+        uint64_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        byte(0xcb);
+        big_endian(bits);
+    }
+
+    void str(const char* s, size_t len) {
+        if (len < 32) {
+            byte(0xa0 | static_cast<uint8_t>(len));
+        } else if (len <= UINT8_MAX) {
+            byte(0xd9);
+            byte(static_cast<uint8_t>(len));
+        } else if (len <= UINT16_MAX) {
+            byte(0xda);
+            big_endian(static_cast<uint16_t>(len));
+        } else {
+            byte(0xdb);
+            big_endian(static_cast<uint32_t>(len));
+        }
+        out.append(s, len);
+    }
+
+    void bin(const G* data, size_t len) {
+        if (len <= UINT8_MAX) {
+            byte(0xc4);
+            byte(static_cast<uint8_t>(len));
+        } else if (len <= UINT16_MAX) {
+            byte(0xc5);
+            big_endian(static_cast<uint16_t>(len));
+        } else {
+            byte(0xc6);
+            big_endian(static_cast<uint32_t>(len));
+        }
+        out.append(reinterpret_cast<const char*>(data), len);
+    }
+
+    void array_header(J n) { container_header(n, 0x90, 0xdc, 0xdd); }
+
+    void map_header(J n) { container_header(n, 0x80, 0xde, 0xdf); }
+
+    void ext_header(int8_t type, size_t len) {
+        switch (len) {
+            case 1:  byte(0xd4); break;
+            case 2:  byte(0xd5); break;
+            case 4:  byte(0xd6); break;
+            case 8:  byte(0xd7); break;
+            case 16: byte(0xd8); break;
+            default:
+                if (len <= UINT8_MAX) {
+                    byte(0xc7);
+                    byte(static_cast<uint8_t>(len));
+                } else if (len <= UINT16_MAX) {
+                    byte(0xc8);
+                    big_endian(static_cast<uint16_t>(len));
+                } else {
+                    byte(0xc9);
+                    big_endian(static_cast<uint32_t>(len));
+                }
+        }
+        byte(static_cast<uint8_t>(type));
+    }
+
+    // Extension whose payload length is only known once it is written
+    size_t begin_ext(int8_t type) {
+        byte(0xc9);
+        big_endian(static_cast<uint32_t>(0));
+        byte(static_cast<uint8_t>(type));
+        return out.size();
+    }
+
+    void end_ext(size_t start) {
+        const uint32_t len = swap_bytes(static_cast<uint32_t>(out.size() - start));
+        memcpy(&out[start - 5], &len, sizeof(len));
+    }
+
+private:
+    void container_header(J n, uint8_t fix, uint8_t head16, uint8_t head32) {
+        if (n < 16) {
+            byte(fix | static_cast<uint8_t>(n));
+        } else if (n <= UINT16_MAX) {
+            byte(head16);
+            big_endian(static_cast<uint16_t>(n));
+        } else {
+            byte(head32);
+            big_endian(static_cast<uint32_t>(n));
+        }
+    }
+};
+
+void encode(Packer& p, K x);
+
+void encode_timestamp(Packer& p, J n) {
+    // Floor division keeps the nanoseconds positive; unsigned arithmetic
+    // lets the null and infinite timestamps round-trip
+    J sec = n / NANOS_IN_SEC;
+    J nsec = n % NANOS_IN_SEC;
+    if (nsec < 0) {
+        sec -= 1;
+        nsec += NANOS_IN_SEC;
+    }
+    p.ext_header(EXT_TIMESTAMP, 12);
+    p.big_endian(static_cast<uint32_t>(nsec));
+    p.big_endian(static_cast<uint64_t>(sec + SECS_1970_TO_2000));
+}
+
+void encode_symbol(Packer& p, S s) {
+    const size_t len = s ? strlen(s) : 0;
+    p.ext_header(EXT_ATOM | KS, len);
+    p.out.append(s ? s : "", len);
+}
+
+// Encode one value of type t stored at data, as an atom
+void encode_item(Packer& p, int t, const G* data) {
+    switch (t) {
+        case KB:
+            p.boolean(*data != 0);
+            break;
+        case KJ: {
+            J n;
+            memcpy(&n, data, sizeof(n));
+            p.integer(n);
+            break;
+        }
+        case KF: {
+            F f;
+            memcpy(&f, data, sizeof(f));
+            p.float64(f);
+            break;
+        }
+        case KE: {
+            E e;
+            memcpy(&e, data, sizeof(e));
+            p.float32(e);
+            break;
+        }
+        case KP: {
+            J n;
+            memcpy(&n, data, sizeof(n));
+            encode_timestamp(p, n);
+            break;
+        }
+        case KS: {
+            S s;
+            memcpy(&s, data, sizeof(s));
+            encode_symbol(p, s);
+            break;
+        }
+        case KC: case KG:
+            p.ext_header(EXT_ATOM | t, 1);
+            p.byte(*data);
+            break;
+        case KH: {
+            uint16_t v;
+            memcpy(&v, data, sizeof(v));
+            p.ext_header(EXT_ATOM | t, sizeof(v));
+            p.big_endian(v);
+            break;
+        }
+        case KI: case KM: case KD: case KU: case KV: case KT: {
+            uint32_t v;
+            memcpy(&v, data, sizeof(v));
+            p.ext_header(EXT_ATOM | t, sizeof(v));
+            p.big_endian(v);
+            break;
+        }
+        case KN: case KZ: {
+            uint64_t v;
+            memcpy(&v, data, sizeof(v));
+            p.ext_header(EXT_ATOM | t, sizeof(v));
+            p.big_endian(v);
+            break;
+        }
+        case UU:
+            p.ext_header(EXT_ATOM | t, 16);
+            p.out.append(reinterpret_cast<const char*>(data), 16);
+            break;
+        default:
+            p.nil();
+            break;
+    }
+}
+
+void encode_vector(Packer& p, K x) {
+    const int t = x->t;
+    const int width = item_width(t);
+    p.ext_header(static_cast<int8_t>(t), x->n * width);
+    switch (width) {
+        case 2:
+            p.big_endian_block<uint16_t>(kG(x), x->n);
+            break;
+        case 4:
+            p.big_endian_block<uint32_t>(kG(x), x->n);
+            break;
+        case 8:
+            p.big_endian_block<uint64_t>(kG(x), x->n);
+            break;
+        default:
+            // Booleans and guids are byte strings already
+            p.out.append(reinterpret_cast<const char*>(kG(x)), x->n * width);
+            break;
+    }
+}
+
+void encode_symbols(Packer& p, const S* syms, J n) {
+    size_t len = 0;
+    for (J idx = 0; idx < n; ++idx) {
+        len += (syms[idx] ? strlen(syms[idx]) : 0) + 1;
+    }
+    p.ext_header(KS, len);
+    for (J idx = 0; idx < n; ++idx) {
+        if (syms[idx]) p.out.append(syms[idx]);
+        p.byte(0);
+    }
+}
+
+void encode_enum(Packer& p, K x) {
+    K domain = k(0, (S)"sym", (K)0);
+    if (!domain || domain->t != KS) {
+        if (domain) r0(domain);
+        p.nil();
+        return;
+    }
+
+    auto resolve = [&](J idx) -> S {
+        return (idx == nj || idx < 0 || idx >= domain->n) ? nullptr : kS(domain)[idx];
+    };
+
+    if (x->t < 0) {
+        encode_symbol(p, resolve(x->j));
+    } else {
+        std::vector<S> syms(x->n, nullptr);
+        for (J idx = 0; idx < x->n; ++idx) {
+            syms[idx] = resolve(kJ(x)[idx]);
+        }
+        encode_symbols(p, syms.data(), x->n);
+    }
+    r0(domain);
+}
+
+void encode_dict(Packer& p, K x) {
+    const K keys = kK(x)[0];
+    const K values = kK(x)[1];
+
+    if (keys->t == KS && values->t >= 0 && values->t <= KT) {
+        p.map_header(keys->n);
+        for (J idx = 0; idx < keys->n; ++idx) {
+            S key = kS(keys)[idx];
+            p.str(key, strlen(key));
+            if (values->t == 0) {
+                encode(p, kK(values)[idx]);
+            } else {
+                encode_item(p, values->t, kG(values) + idx * (values->t == KS ? sizeof(S) : item_width(values->t)));
+            }
+        }
+    } else {
+        const size_t start = p.begin_ext(EXT_DICT);
+        p.array_header(2);
+        encode(p, keys);
+        encode(p, values);
+        p.end_ext(start);
+    }
+}
+
+void encode_table(Packer& p, K x) {
+    const K keys = kK(x->k)[0];
+    const K values = kK(x->k)[1];
+
+    const size_t start = p.begin_ext(EXT_TABLE);
+    p.map_header(keys->n);
+    for (J col = 0; col < keys->n; ++col) {
+        S key = kS(keys)[col];
+        p.str(key, strlen(key));
+        encode(p, kK(values)[col]);
+    }
+    p.end_ext(start);
+}
+
+void encode(Packer& p, K x) {
+    switch (x->t) {
+        case 0:
+            p.array_header(x->n);
+            for (J idx = 0; idx < x->n; ++idx) {
+                encode(p, kK(x)[idx]);
+            }
+            break;
+        case KC:
+            p.str(reinterpret_cast<const char*>(kC(x)), x->n);
+            break;
+        case KG:
+            p.bin(kG(x), x->n);
+            break;
+        case KS:
+            encode_symbols(p, kS(x), x->n);
+            break;
+        case KB: case UU: case KH: case KI: case KJ: case KE: case KF:
+        case KD: case KZ: case KP: case KN: case KM: case KU: case KV: case KT:
+            encode_vector(p, x);
+            break;
+        case -KS:
+            encode_symbol(p, x->s);
+            break;
+        case -KB: case -UU: case -KG: case -KC: case -KH: case -KI: case -KJ: case -KE: case -KF:
+        case -KD: case -KZ: case -KP: case -KN: case -KM: case -KU: case -KV: case -KT:
+            encode_item(p, -x->t, -x->t == UU ? kG(x) : &x->g);
+            break;
+        case XT:
+            encode_table(p, x);
+            break;
+        case XD:
+            encode_dict(p, x);
+            break;
+        case 20:
+        case -20:
+            encode_enum(p, x);
+            break;
+        default:
+            p.nil();
+            break;
+    }
+}
+
+class Unpacker {
+public:
+    Unpacker(const G* data, size_t len) : p_(data), end_(data + len) {}
+
+    const char* error = nullptr;
+
+    bool done() const { return p_ == end_; }
+
+    // Decode one value; returns nullptr and sets error on malformed input.
+    // Map values are collapsed with vk unless they are table columns.
+    K decode(bool collapse = true) {
+        uint8_t b;
+        if (!take(b)) return nullptr;
+
+        if (b <= 0x7f) return kj(b);
+        if (b >= 0xe0) return kj(static_cast<int8_t>(b));
+        if ((b & 0xf0) == 0x80) return decode_map(b & 0x0f, collapse);
+        if ((b & 0xf0) == 0x90) return decode_array(b & 0x0f);
+        if ((b & 0xe0) == 0xa0) return decode_str(b & 0x1f);
+
+        switch (b) {
+            case 0xc0: {
+                K r = ka(101);
+                r->g = 0;
+                return r;
+            }
+            case 0xc2: return kb(0);
+            case 0xc3: return kb(1);
+            case 0xc4: return decode_bin(read_len<uint8_t>());
+            case 0xc5: return decode_bin(read_len<uint16_t>());
+            case 0xc6: return decode_bin(read_len<uint32_t>());
+            case 0xc7: return decode_ext(read_len<uint8_t>());
+            case 0xc8: return decode_ext(read_len<uint16_t>());
+            case 0xc9: return decode_ext(read_len<uint32_t>());
+            case 0xca: {
+                uint32_t bits;
+                if (!read(bits)) return nullptr;
+                E e;
+                memcpy(&e, &bits, sizeof(e));
+                return ke(e);
+            }
+            case 0xcb: {
+                uint64_t bits;
+                if (!read(bits)) return nullptr;
+                F f;
+                memcpy(&f, &bits, sizeof(f));
+                return kf(f);
+            }
+            case 0xcc: return decode_int<uint8_t>();
+            case 0xcd: return decode_int<uint16_t>();
+            case 0xce: return decode_int<uint32_t>();
+            case 0xcf: return decode_int<uint64_t>();
+            case 0xd0: return decode_int<uint8_t, int8_t>();
+            case 0xd1: return decode_int<uint16_t, int16_t>();
+            case 0xd2: return decode_int<uint32_t, int32_t>();
+            case 0xd3: return decode_int<uint64_t, int64_t>();
+            case 0xd4: return decode_ext(1);
+            case 0xd5: return decode_ext(2);
+            case 0xd6: return decode_ext(4);
+            case 0xd7: return decode_ext(8);
+            case 0xd8: return decode_ext(16);
+            case 0xd9: return decode_str(read_len<uint8_t>());
+            case 0xda: return decode_str(read_len<uint16_t>());
+            case 0xdb: return decode_str(read_len<uint32_t>());
+            case 0xdc: return decode_array(read_len<uint16_t>());
+            case 0xdd: return decode_array(read_len<uint32_t>());
+            case 0xde: return decode_map(read_len<uint16_t>(), collapse);
+            case 0xdf: return decode_map(read_len<uint32_t>(), collapse);
+            default:
+                return fail("Type error: Unsupported MessagePack type");
+        }
+    }
+
+private:
+    K fail(const char* message) {
+        if (!error) error = message;
+        return nullptr;
+    }
+
+    bool take(uint8_t& b) {
+        if (p_ >= end_) {
+            fail("Parse error: Unexpected end of MessagePack data");
+            return false;
+        }
+        b = *p_++;
+        return true;
+    }
+
+    template<typename T>
+    bool read(T& v) {
+        if (static_cast<size_t>(end_ - p_) < sizeof(T)) {
+            fail("Parse error: Unexpected end of MessagePack data");
+            return false;
+        }
+        memcpy(&v, p_, sizeof(T));
+        v = swap_bytes(v);
+        p_ += sizeof(T);
+        return true;
+    }
+
+    // Lengths that cannot be read are reported as larger than any input
+    template<typename T>
+    size_t read_len() {
+        T len;
+        return read(len) ? len : SIZE_MAX;
+    }
+
+    const G* bytes(size_t len) {
+        if (len == SIZE_MAX || static_cast<size_t>(end_ - p_) < len) {
+            fail("Parse error: Unexpected end of MessagePack data");
+            return nullptr;
+        }
+        const G* start = p_;
+        p_ += len;
+        return start;
+    }
+
+    template<typename T, typename Signed = T>
+    K decode_int() {
+        T v;
+        if (!read(v)) return nullptr;
+        return kj(static_cast<J>(static_cast<Signed>(v)));
+    }
+
+    K decode_str(size_t len) {
+        const G* data = bytes(len);
+        return data ? kpn((S)data, len) : nullptr;
+    }
+
+    K decode_bin(size_t len) {
+        const G* data = bytes(len);
+        if (!data) return nullptr;
+        K r = ktn(KG, len);
+        memcpy(kG(r), data, len);
+        return r;
+    }
+
+    K decode_array(size_t n) {
+        if (n == SIZE_MAX) return nullptr;
+        K list = ktn(0, n);
+        for (size_t idx = 0; idx < n; ++idx) {
+            K v = decode();
+            if (!v) {
+                list->n = idx;
+                r0(list);
+                return nullptr;
+            }
+            kK(list)[idx] = v;
+        }
+        return list;
+    }
+
+    K decode_map(size_t n, bool collapse) {
+        if (n == SIZE_MAX) return nullptr;
+        K keys = ktn(KS, n);
+        K values = ktn(0, n);
+        for (size_t idx = 0; idx < n; ++idx) {
+            uint8_t b;
+            size_t len = SIZE_MAX;
+            if (take(b)) {
+                if ((b & 0xe0) == 0xa0) len = b & 0x1f;
+                else if (b == 0xd9) len = read_len<uint8_t>();
+                else if (b == 0xda) len = read_len<uint16_t>();
+                else if (b == 0xdb) len = read_len<uint32_t>();
+                else fail("Type error: MessagePack map keys must be strings");
+            }
+            const G* key = len == SIZE_MAX ? nullptr : bytes(len);
+            K v = key ? decode() : nullptr;
+            if (!v) {
+                keys->n = idx;
+                values->n = idx;
+                r0(keys);
+                r0(values);
+                return nullptr;
+            }
+            kS(keys)[idx] = sn((S)key, len);
+            kK(values)[idx] = v;
+        }
+        return xD(keys, collapse ? vk(values) : values);
+    }
+
+    K decode_timestamp(const G* data, size_t len) {
+        uint64_t sec;
+        uint32_t nsec = 0;
+        if (len == 4) {
+            sec = load_big_endian<uint32_t>(data);
+        } else if (len == 8) {
+            const uint64_t packed = load_big_endian<uint64_t>(data);
+            nsec = static_cast<uint32_t>(packed >> 34);
+            sec = packed & 0x3ffffffffULL;
+        } else if (len == 12) {
+            nsec = load_big_endian<uint32_t>(data);
+            sec = load_big_endian<uint64_t>(data + 4);
+        } else {
+            return fail("Parse error: Invalid MessagePack timestamp");
+        }
+        const uint64_t nanos = (sec - SECS_1970_TO_2000) * NANOS_IN_SEC + nsec;
+        return ktj(-KP, static_cast<J>(nanos));
+    }
+
+    K decode_atom(int t, const G* data, size_t len) {
+        if (t == KS) {
+            return ks(sn((S)data, len));
+        }
+        const int width = item_width(t);
+        if (width == 0 || static_cast<size_t>(width) != len) {
+            return fail("Parse error: Invalid MessagePack atom extension");
+        }
+        if (t == UU) {
+            U u;
+            memcpy(&u, data, sizeof(u));
+            return ku(u);
+        }
+        K r = ka(-t);
+        switch (width) {
+            case 1: r->g = *data; break;
+            case 2: { const uint16_t v = load_big_endian<uint16_t>(data); memcpy(&r->h, &v, sizeof(v)); break; }
+            case 4: { const uint32_t v = load_big_endian<uint32_t>(data); memcpy(&r->i, &v, sizeof(v)); break; }
+            case 8: { const uint64_t v = load_big_endian<uint64_t>(data); memcpy(&r->j, &v, sizeof(v)); break; }
+        }
+        return r;
+    }
+
+    K decode_vector(int t, const G* data, size_t len) {
+        if (t == KS) {
+            J n = 0;
+            for (size_t idx = 0; idx < len; ++idx) {
+                n += data[idx] == 0;
+            }
+            if (len && data[len - 1] != 0) {
+                return fail("Parse error: Unterminated symbol in MessagePack extension");
+            }
+            K r = ktn(KS, n);
+            const G* s = data;
+            for (J idx = 0; idx < n; ++idx) {
+                const size_t slen = strlen((const char*)s);
+                kS(r)[idx] = sn((S)s, slen);
+                s += slen + 1;
+            }
+            return r;
+        }
+        const int width = item_width(t);
+        if (width == 0 || len % width != 0) {
+            return fail("Parse error: Invalid MessagePack vector extension");
+        }
+        const J n = len / width;
+        K r = ktn(t, n);
+        for (J idx = 0; idx < n; ++idx) {
+            const G* item = data + idx * width;
+            switch (width) {
+                case 2: kH(r)[idx] = load_big_endian<uint16_t>(item); break;
+                case 4: { const uint32_t v = load_big_endian<uint32_t>(item); memcpy(kI(r) + idx, &v, sizeof(v)); break; }
+                case 8: { const uint64_t v = load_big_endian<uint64_t>(item); memcpy(kJ(r) + idx, &v, sizeof(v)); break; }
+                default: memcpy(kG(r) + idx * width, item, width); break;
+            }
+        }
+        return r;
+    }
+
+    K decode_nested(int8_t type, const G* data, size_t len) {
+        Unpacker payload(data, len);
+        K x = payload.decode(type != EXT_TABLE);
+        if (!x) return fail(payload.error);
+        if (!payload.done()) {
+            r0(x);
+            return fail("Parse error: Trailing bytes in MessagePack extension");
+        }
+        if (type == EXT_TABLE) {
+            if (x->t != XD) {
+                r0(x);
+                return fail("Parse error: Invalid MessagePack table extension");
+            }
+            K table = xT(x);
+            return table ? table : fail("Parse error: Invalid MessagePack table extension");
+        }
+        if (x->t != 0 || x->n != 2) {
+            r0(x);
+            return fail("Parse error: Invalid MessagePack dictionary extension");
+        }
+        K dict = xD(r1(kK(x)[0]), r1(kK(x)[1]));
+        r0(x);
+        return dict;
+    }
+
+    K decode_ext(size_t len) {
+        uint8_t type;
+        if (len == SIZE_MAX || !take(type)) return nullptr;
+        const G* data = bytes(len);
+        if (!data) return nullptr;
+
+        const int8_t ext = static_cast<int8_t>(type);
+        if (ext == EXT_TIMESTAMP) return decode_timestamp(data, len);
+        if (ext == EXT_TABLE || ext == EXT_DICT) return decode_nested(ext, data, len);
+        if (ext > EXT_ATOM && ext <= (EXT_ATOM | KT)) return decode_atom(ext & ~EXT_ATOM, data, len);
+        if (ext > 0 && ext <= KT) return decode_vector(ext, data, len);
+        return fail("Type error: Unsupported MessagePack extension");
+    }
+
+    const G* p_;
+    const G* end_;
+};
+
+}  // namespace
+
+}  // namespace kjson
+
+extern "C" {
+
+K ktom(K x) {
+    kjson::Packer packer;
+    kjson::encode(packer, x);
+
+    K r = ktn(KG, packer.out.size());
+    memcpy(kG(r), packer.out.data(), packer.out.size());
+    return r;
+}
+
+K mtok(K x) {
+    if (x->t != KG && x->t != KC) {
+        return krr(const_cast<S>("Type error: Input must be a byte vector"));
+    }
+
+    kjson::Unpacker unpacker(kG(x), x->n);
+    K r = unpacker.decode();
+    if (!r) {
+        return krr(const_cast<S>(unpacker.error));
+    }
+    if (!unpacker.done()) {
+        r0(r);
+        return krr(const_cast<S>("Parse error: Trailing bytes after MessagePack value"));
+    }
+    return r;
+}
+
+}  // extern "C"
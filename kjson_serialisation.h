@@ -11,11 +11,11 @@ namespace kjson {
 
 // Forward declarations for serialization functions
 template <typename Writer>
-void serialise_atom(Writer& w, const K x, int i = -1);
+void serialise_atom(Writer& w, const K x, J i = -1);
 
 // Add other forward declarations if required
 template<typename Writer>
-void serialise_dict(Writer& w, K x, bool isvec, int i);
+void serialise_dict(Writer& w, K x, bool isvec, J i);
 template<typename Writer>
 void serialise_keyed_table(Writer& w, K keys, K values);
 // Include more as needed...
@@ -26,6 +26,40 @@ void serialise_keyed_table(Writer& w, K keys, K values);
 extern "C" {
     K __attribute__((visibility("default"))) jtok(K json_string);
     K __attribute__((visibility("default"))) ktoj(K x);
+    K __attribute__((visibility("default"))) jtokcache(K budget);
+    K __attribute__((visibility("default"))) jtokcachestats(K x);
+    K __attribute__((visibility("default"))) jtoko(K json_string, K opts);
+    K __attribute__((visibility("default"))) jtoks(K opts);
+    K __attribute__((visibility("default"))) jtoksfeed(K handle, K bytes);
+    K __attribute__((visibility("default"))) jtoksfree(K handle);
+    K __attribute__((visibility("default"))) jtokprep(K sample);
+    K __attribute__((visibility("default"))) jtokexec(K handle, K json_string);
+    K __attribute__((visibility("default"))) jtokfree(K handle);
+    K __attribute__((visibility("default"))) jtokasync(K x, K callback);
+    K __attribute__((visibility("default"))) jtokasynclimits(K max_queue, K max_bytes);
+    K __attribute__((visibility("default"))) jtokasyncstats(K x);
+    K __attribute__((visibility("default"))) jtokshm(K name, K capacity, K callback);
+    K __attribute__((visibility("default"))) jtokshmread(K handle);
+    K __attribute__((visibility("default"))) jtokshmstats(K handle);
+    K __attribute__((visibility("default"))) jtokshmclose(K handle);
+    K __attribute__((visibility("default"))) simdvariant(K x);
+    K __attribute__((visibility("default"))) simdforce(K name);
+    K __attribute__((visibility("default"))) ipctoj(K bytes);
+    K __attribute__((visibility("default"))) jtoipc(K json_string);
+    K __attribute__((visibility("default"))) jtokz(K x);
+    K __attribute__((visibility("default"))) jtoins(K table, K json);
+    K __attribute__((visibility("default"))) ktom(K x);
+    K __attribute__((visibility("default"))) mtok(K x);
+    K __attribute__((visibility("default"))) ktojprep(K sample);
+    K __attribute__((visibility("default"))) ktojexec(K handle, K x);
+    K __attribute__((visibility("default"))) ktojfree(K handle);
+    K __attribute__((visibility("default"))) ktojrows(K x);
+    K __attribute__((visibility("default"))) ktojo(K x, K opts);
+    K __attribute__((visibility("default"))) ktojdelta(K x);
+    K __attribute__((visibility("default"))) ktojdeltaexec(K handle, K x);
+    K __attribute__((visibility("default"))) ktojdeltafree(K handle);
+    K __attribute__((visibility("default"))) ktojv(K x, K cols, K rows);
+    K __attribute__((visibility("default"))) hdbtoj(K root, K table, K partitions, K outdir);
 }
 
 
@@ -0,0 +1,292 @@
+/* File: kjson_shm.cpp */
+
+#include "kjson_serialisation.h"
+#include "kjson_shm.h"
+#include "kjson_utils.h"
+#include <sys/stat.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace kjson {
+
+namespace {
+
+// Consumer end of a ring created by jtokshm. Messages are parsed straight
+// from the shared mapping; the only copies are the K objects built from them.
+struct ShmConsumer {
+    std::string name;
+    shm::RingHeader* ring = nullptr;
+    size_t mapped = 0;
+    int fifo_read = -1;
+    int fifo_write = -1;   // Keeps the FIFO open so reads never see EOF
+    K callback = nullptr;  // Held with r1, or null in polling mode
+
+    J messages = 0;
+    J bytes = 0;
+    J failed = 0;
+    J batches = 0;
+    J callback_errors = 0;
+    std::string last_error;
+
+    ~ShmConsumer() {
+        if (callback) {
+            // sd0 closes the descriptor as well
+            sd0(fifo_read);
+            r0(callback);
+        } else if (fifo_read >= 0) {
+            close(fifo_read);
+        }
+        if (fifo_write >= 0) close(fifo_write);
+        if (ring) {
+            munmap(ring, mapped);
+            shm_unlink(shm::segment_name(name).c_str());
+            unlink(shm::fifo_path(name).c_str());
+        }
+    }
+
+    bool pending() const {
+        return ring->head.load(std::memory_order_seq_cst) != ring->tail.load(std::memory_order_relaxed);
+    }
+
+    // Parse every published message into a list collapsed with vk, so a
+    // batch of same-keyed objects arrives as a table
+    K read_batch() {
+        const uint64_t mask = ring->capacity - 1;
+        const char* base = shm::records(ring);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+
+        char pool[4096];
+        rapidjson::MemoryPoolAllocator<> allocator(pool, sizeof(pool));
+        std::vector<K> values;
+
+        while (tail != head) {
+            const uint64_t offset = tail & mask;
+            uint32_t length;
+            std::memcpy(&length, base + offset, sizeof(uint32_t));
+            if (length == shm::PAD_RECORD) {
+                tail += ring->capacity - offset;
+                continue;
+            }
+            // The length comes from the producer. A record that would run
+            // past the end of the ring, or past what has been published,
+            // means the producer is broken or stale; the position of the
+            // next record cannot be trusted either, so drop what is pending.
+            if (length > ring->capacity - offset - sizeof(uint32_t) || shm::record_size(length) > head - tail) {
+                ++failed;
+                ++messages;
+                tail = head;
+                ring->tail.store(tail, std::memory_order_release);
+                break;
+            }
+
+            rapidjson::Document document(&allocator);
+            document.Parse(base + offset + sizeof(uint32_t), length);
+            if (document.HasParseError()) {
+                ++failed;
+            } else {
+                try {
+                    values.push_back(json_to_kobject(document));
+                } catch (const std::exception&) {
+                    ++failed;
+                }
+            }
+            allocator.Clear();
+
+            tail += shm::record_size(length);
+            bytes += length;
+            ++messages;
+            // Hand the space back as we go so the producer is not held up
+            // by a long batch
+            ring->tail.store(tail, std::memory_order_release);
+        }
+
+        ++batches;
+        K list = ktn(0, values.size());
+        for (size_t idx = 0; idx < values.size(); ++idx) {
+            kK(list)[idx] = values[idx];
+        }
+        return list->n ? vk(list) : list;
+    }
+
+    K stats() const {
+        const char* names[] = {"messages", "bytes", "failed", "batches", "capacity", "used",
+                               "callbackerrors", "lasterror"};
+        const J counters[] = {messages, bytes, failed, batches, static_cast<J>(ring->capacity),
+                              static_cast<J>(ring->head.load() - ring->tail.load()), callback_errors};
+        const int count = sizeof(names) / sizeof(names[0]);
+        K keys = ktn(KS, count);
+        K values = ktn(0, count);
+        for (int idx = 0; idx < count; ++idx) {
+            kS(keys)[idx] = ss(const_cast<S>(names[idx]));
+            kK(values)[idx] = idx < count - 1 ? kj(counters[idx]) : kp(const_cast<S>(last_error.c_str()));
+        }
+        return xD(keys, values);
+    }
+};
+
+HandleTable<ShmConsumer> shm_consumers;
+std::unordered_map<I, J> shm_fds;  // FIFO descriptor to handle, for sd1
+
+K on_wakeup(I fd) {
+    auto it = shm_fds.find(fd);
+    const J handle = it == shm_fds.end() ? 0 : it->second;
+    ShmConsumer* consumer = shm_consumers.get(handle);
+    if (!consumer) {
+        return (K)0;
+    }
+
+    char drain[256];
+    while (read(fd, drain, sizeof(drain)) > 0) {
+    }
+
+    K batch = consumer->read_batch();
+    if (batch->n) {
+        K r = k(0, const_cast<S>("."), r1(consumer->callback), knk(1, batch), (K)0);
+        if (r && r->t == -128) {
+            // The callback may have closed the ring
+            consumer = shm_consumers.get(handle);
+            if (consumer) {
+                ++consumer->callback_errors;
+                consumer->last_error = r->s;
+            }
+        }
+        if (r) r0(r);
+    } else {
+        r0(batch);
+    }
+
+    // The callback may have closed the ring
+    consumer = shm_consumers.get(handle);
+    if (!consumer) {
+        return (K)0;
+    }
+
+    // Say we are waiting before the final check, so a message published
+    // in between either is seen here or makes the producer wake us. If more
+    // arrived, requeue through our own FIFO to give the main loop a turn.
+    consumer->ring->waiting.store(1, std::memory_order_seq_cst);
+    if (consumer->pending() && consumer->ring->waiting.exchange(0)) {
+        const char wake = 1;
+        if (write(consumer->fifo_write, &wake, 1) < 0) {
+            // The FIFO already holds a wakeup
+        }
+    }
+    return (K)0;
+}
+
+bool is_power_of_two(J n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+}  // namespace
+
+}  // namespace kjson
+
+extern "C" {
+
+K jtokshm(K name, K capacity, K callback) {
+    if (name->t != -KS) {
+        return krr(const_cast<S>("Type error: Ring name must be a symbol"));
+    }
+    if (capacity->t != -KJ || !kjson::is_power_of_two(capacity->j) || capacity->j < 4096) {
+        return krr(const_cast<S>("Type error: Capacity must be a long power of two, at least 4096"));
+    }
+    if (callback->t != 101 && (callback->t < 100 || callback->t > 111)) {
+        return krr(const_cast<S>("Type error: Callback must be a function or (::) to poll"));
+    }
+
+    auto consumer = std::make_unique<kjson::ShmConsumer>();
+    consumer->name = name->s;
+    const std::string segment = kjson::shm::segment_name(consumer->name);
+    const std::string fifo = kjson::shm::fifo_path(consumer->name);
+
+    // A ring left behind by a process that did not close it is replaced
+    shm_unlink(segment.c_str());
+    int fd = shm_open(segment.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return krr(const_cast<S>("Shm error: Unable to create shared memory segment"));
+    }
+    consumer->mapped = kjson::shm::mapping_size(capacity->j);
+    if (ftruncate(fd, consumer->mapped) < 0) {
+        close(fd);
+        shm_unlink(segment.c_str());
+        return krr(const_cast<S>("Shm error: Unable to size shared memory segment"));
+    }
+    void* addr = mmap(nullptr, consumer->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        shm_unlink(segment.c_str());
+        return krr(const_cast<S>("Shm error: Unable to map shared memory segment"));
+    }
+
+    auto* ring = new (addr) kjson::shm::RingHeader();
+    ring->capacity = capacity->j;
+    ring->head.store(0);
+    ring->tail.store(0);
+    ring->waiting.store(0);
+    consumer->ring = ring;
+
+    unlink(fifo.c_str());
+    if (mkfifo(fifo.c_str(), 0600) < 0 ||
+        (consumer->fifo_read = open(fifo.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0 ||
+        (consumer->fifo_write = open(fifo.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        return krr(const_cast<S>("Shm error: Unable to create wakeup FIFO"));
+    }
+
+    if (callback->t != 101) {
+        consumer->callback = r1(callback);
+        sd1(consumer->fifo_read, kjson::on_wakeup);
+        ring->waiting.store(1);
+    }
+
+    // Publish the magic last: producers refuse to attach until it is set
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->magic = kjson::shm::RING_MAGIC;
+
+    const I fifo_fd = consumer->fifo_read;
+    const J handle = kjson::shm_consumers.add(std::move(consumer));
+    kjson::shm_fds[fifo_fd] = handle;
+    return kj(handle);
+}
+
+K jtokshmread(K handle) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    kjson::ShmConsumer* consumer = kjson::shm_consumers.get(h);
+    if (!consumer) {
+        return krr(const_cast<S>("Handle error: Unknown ring handle"));
+    }
+    return consumer->read_batch();
+}
+
+K jtokshmstats(K handle) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    kjson::ShmConsumer* consumer = kjson::shm_consumers.get(h);
+    if (!consumer) {
+        return krr(const_cast<S>("Handle error: Unknown ring handle"));
+    }
+    return consumer->stats();
+}
+
+K jtokshmclose(K handle) {
+    J h;
+    if (!kjson::get_handle(handle, h)) {
+        return krr(const_cast<S>("Type error: Handle must be a long"));
+    }
+    kjson::ShmConsumer* consumer = kjson::shm_consumers.get(h);
+    if (consumer) {
+        kjson::shm_fds.erase(consumer->fifo_read);
+    }
+    return kb(kjson::shm_consumers.erase(h));
+}
+
+}  // extern "C"
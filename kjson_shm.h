@@ -0,0 +1,156 @@
+#ifndef KJSON_SHM_H
+#define KJSON_SHM_H
+
+// Single-producer/single-consumer ring of JSON messages in POSIX shared
+// memory. The consumer (jtokshm in the library) creates the ring and a FIFO
+// for wakeups; a producer process attaches with RingWriter. This header has
+// no k.h or RapidJSON dependency so gateways can include it directly.
+//
+// Layout: a RingHeader followed by `capacity` bytes of records. Each record
+// is a 4-byte length and the message bytes, padded to 8 bytes, and never
+// wraps: a record that would cross the end of the buffer is preceded by a
+// PAD_RECORD filling the rest, so every message can be parsed in place.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace kjson {
+namespace shm {
+
+constexpr uint64_t RING_MAGIC = 0x676e72736e6f736bULL;  // "ksonsrng"
+constexpr uint32_t PAD_RECORD = 0xffffffffu;
+
+struct RingHeader {
+    uint64_t magic;
+    uint64_t capacity;                         // Bytes of records, a power of two
+    alignas(64) std::atomic<uint64_t> head;    // Bytes published, written by the producer
+    alignas(64) std::atomic<uint64_t> tail;    // Bytes consumed, written by the consumer
+    alignas(64) std::atomic<uint32_t> waiting; // Consumer is blocked on the FIFO
+};
+
+inline size_t record_size(size_t length) {
+    return (sizeof(uint32_t) + length + 7) & ~static_cast<size_t>(7);
+}
+
+inline size_t mapping_size(uint64_t capacity) {
+    return sizeof(RingHeader) + capacity;
+}
+
+inline char* records(RingHeader* ring) {
+    return reinterpret_cast<char*>(ring + 1);
+}
+
+// shm_open name and FIFO path for a ring name such as "quotes"
+inline std::string segment_name(const std::string& name) {
+    return "/kjson_" + name;
+}
+
+inline std::string fifo_path(const std::string& name) {
+    return "/tmp/kjson_" + name + ".fifo";
+}
+
+// Producer side. Messages are copied into the ring and published with a
+// release store of head; the consumer is woken through the FIFO only when
+// it has said it is waiting, so a busy ring costs no system calls.
+class RingWriter {
+public:
+    ~RingWriter() { close(); }
+
+    bool open(const std::string& name) {
+        int fd = shm_open(segment_name(name).c_str(), O_RDWR, 0);
+        if (fd < 0) {
+            return false;
+        }
+        uint64_t prefix[2];  // magic and capacity
+        if (pread(fd, prefix, sizeof(prefix), 0) != sizeof(prefix) || prefix[0] != RING_MAGIC) {
+            ::close(fd);
+            return false;
+        }
+        mapped_ = mapping_size(prefix[1]);
+        void* addr = mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        ring_ = static_cast<RingHeader*>(addr);
+        mask_ = ring_->capacity - 1;
+        head_ = ring_->head.load(std::memory_order_relaxed);
+        tail_ = ring_->tail.load(std::memory_order_acquire);
+        fifo_ = ::open(fifo_path(name).c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        return true;
+    }
+
+    void close() {
+        if (ring_) {
+            munmap(ring_, mapped_);
+            ring_ = nullptr;
+        }
+        if (fifo_ >= 0) {
+            ::close(fifo_);
+            fifo_ = -1;
+        }
+    }
+
+    // Largest message that always fits, whatever the wrap position
+    size_t max_message() const {
+        return ring_ ? ring_->capacity / 2 - sizeof(uint32_t) : 0;
+    }
+
+    // Returns false if the ring is full (or the message can never fit);
+    // the caller decides whether to spin, drop or back off
+    bool write(const char* data, size_t length) {
+        if (!ring_ || length > max_message()) {
+            return false;
+        }
+        const size_t need = record_size(length);
+        const size_t offset = head_ & mask_;
+        const size_t contiguous = ring_->capacity - offset;
+        const size_t total = need > contiguous ? contiguous + need : need;
+
+        if (ring_->capacity - (head_ - tail_) < total) {
+            tail_ = ring_->tail.load(std::memory_order_acquire);
+            if (ring_->capacity - (head_ - tail_) < total) {
+                return false;
+            }
+        }
+
+        char* base = records(ring_);
+        if (need > contiguous) {
+            std::memcpy(base + offset, &PAD_RECORD, sizeof(uint32_t));
+            head_ += contiguous;
+        }
+        const uint32_t size = static_cast<uint32_t>(length);
+        char* record = base + (head_ & mask_);
+        std::memcpy(record, &size, sizeof(uint32_t));
+        std::memcpy(record + sizeof(uint32_t), data, length);
+        head_ += need;
+        ring_->head.store(head_, std::memory_order_seq_cst);
+
+        if (ring_->waiting.load(std::memory_order_seq_cst) && ring_->waiting.exchange(0)) {
+            const char wake = 1;
+            if (fifo_ < 0 || ::write(fifo_, &wake, 1) < 0) {
+                // No reader or the FIFO is already full of wakeups
+            }
+        }
+        return true;
+    }
+
+private:
+    RingHeader* ring_ = nullptr;
+    size_t mapped_ = 0;
+    uint64_t mask_ = 0;
+    uint64_t head_ = 0;
+    uint64_t tail_ = 0;  // Last tail seen, reloaded only when the ring looks full
+    int fifo_ = -1;
+};
+
+}  // namespace shm
+}  // namespace kjson
+
+#endif  // KJSON_SHM_H
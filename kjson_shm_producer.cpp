@@ -0,0 +1,61 @@
+/* File: kjson_shm_producer.cpp */
+
+// Reference producer for jtokshm rings, used by the tests and shmbench.q.
+// Usage: kjson_shm_producer name count [rate]
+//   name    ring name given to jtokshm
+//   count   messages to write
+//   rate    messages per second, 0 (the default) for as fast as possible
+// Each message carries its send time in "ts" (nanoseconds since the Unix
+// epoch) so the consumer can measure latency.
+
+#include "kjson_shm.h"
+#include <sched.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s name count [rate]\n", argv[0]);
+        return 1;
+    }
+    const long long count = atoll(argv[2]);
+    const long long rate = argc > 3 ? atoll(argv[3]) : 0;
+
+    kjson::shm::RingWriter writer;
+    if (!writer.open(argv[1]))
+    {
+        fprintf(stderr, "unable to attach to ring %s\n", argv[1]);
+        return 1;
+    }
+
+    const char* syms[] = {"AAPL", "MSFT", "GOOG", "AMZN", "IBM"};
+    const auto start = std::chrono::steady_clock::now();
+    long long full = 0;
+    char message[256];
+
+    for (long long seq = 0; seq < count; ++seq)
+    {
+        if (rate > 0)
+        {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(seq * 1000000000LL / rate));
+        }
+        const long long ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::system_clock::now().time_since_epoch()).count();
+        const int length = snprintf(message, sizeof(message),
+                                    "{\"seq\":%lld,\"sym\":\"%s\",\"px\":%.2f,\"qty\":%lld,\"ts\":%lld}",
+                                    seq, syms[seq % 5], 100.0 + (seq % 1000) * 0.01, 100 * (1 + seq % 50), ts);
+        while (!writer.write(message, length))
+        {
+            ++full;
+            sched_yield();
+        }
+    }
+
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%lld messages in %.3fs (%.0f msg/s), ring full %lld times\n", count, secs, count / secs, full);
+    return 0;
+}
@@ -0,0 +1,157 @@
+/* File: kjson_simd.cpp */
+
+#include "kjson_simd.h"
+#include "kjson_serialisation.h"
+#include <cstring>  // For strcmp
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KJSON_X86 1
+#endif
+
+namespace kjson {
+namespace simd {
+
+namespace {
+
+inline bool is_special(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+size_t scan_string_scalar(const char* data, size_t len) {
+    size_t pos = 0;
+    while (pos < len && !is_special(static_cast<unsigned char>(data[pos]))) {
+        ++pos;
+    }
+    return pos;
+}
+
+#ifdef KJSON_X86
+
+// PCMPESTRI range match over 16 bytes at a time
+__attribute__((target("sse4.2"))) size_t scan_string_sse42(const char* data, size_t len) {
+    static const char ranges[16] = {'\0', '\x1f', '"', '"', '\\', '\\'};
+    const __m128i set = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ranges));
+    size_t pos = 0;
+    for (; pos + 16 <= len; pos += 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        const int idx = _mm_cmpestri(set, 6, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16) {
+            return pos + idx;
+        }
+    }
+    return pos + scan_string_scalar(data + pos, len - pos);
+}
+
+__attribute__((target("avx2"))) size_t scan_string_avx2(const char* data, size_t len) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    size_t pos = 0;
+    for (; pos + 32 <= len; pos += 32) {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        // Unsigned block <= 0x1f exactly when max(block, 0x1f) == 0x1f
+        const __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(block, control), control));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+    return pos + scan_string_scalar(data + pos, len - pos);
+}
+
+__attribute__((target("avx512f,avx512bw"))) size_t scan_string_avx512(const char* data, size_t len) {
+    const __m512i quote = _mm512_set1_epi8('"');
+    const __m512i backslash = _mm512_set1_epi8('\\');
+    const __m512i control = _mm512_set1_epi8(0x1f);
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        const __m512i block = _mm512_loadu_si512(data + pos);
+        const __mmask64 mask = _mm512_cmpeq_epi8_mask(block, quote) | _mm512_cmpeq_epi8_mask(block, backslash) |
+                               _mm512_cmple_epu8_mask(block, control);
+        if (mask) {
+            return pos + __builtin_ctzll(mask);
+        }
+    }
+    return pos + scan_string_scalar(data + pos, len - pos);
+}
+
+#endif  // KJSON_X86
+
+const Kernels scalar_kernels = {"scalar", scan_string_scalar};
+#ifdef KJSON_X86
+const Kernels sse42_kernels = {"sse42", scan_string_sse42};
+const Kernels avx2_kernels = {"avx2", scan_string_avx2};
+const Kernels avx512_kernels = {"avx512", scan_string_avx512};
+#endif
+
+const Kernels* kernels_for(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        return &scalar_kernels;
+    }
+#ifdef KJSON_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse42") == 0 && __builtin_cpu_supports("sse4.2")) {
+        return &sse42_kernels;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+    if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return &avx512_kernels;
+    }
+#endif
+    return nullptr;
+}
+
+// Widest supported variant, tried once when the library is loaded
+const Kernels* detect() {
+    for (const char* name : {"avx512", "avx2", "sse42"}) {
+        if (const Kernels* kernels = kernels_for(name)) {
+            return kernels;
+        }
+    }
+    return &scalar_kernels;
+}
+
+const Kernels* const detected = detect();
+
+}  // namespace
+
+std::atomic<const Kernels*> active{detected};
+
+const char* variant() {
+    return active.load()->name;
+}
+
+bool select(const char* name) {
+    const Kernels* kernels = strcmp(name, "auto") == 0 ? detected : kernels_for(name);
+    if (!kernels) {
+        return false;
+    }
+    active.store(kernels);
+    return true;
+}
+
+}  // namespace simd
+}  // namespace kjson
+
+extern "C" {
+
+K simdvariant(K /*x*/) {
+    return ks(const_cast<S>(kjson::simd::variant()));
+}
+
+K simdforce(K name) {
+    if (name->t != -KS) {
+        return krr(const_cast<S>("Type error: Variant must be a symbol"));
+    }
+    if (!kjson::simd::select(name->s)) {
+        return krr(const_cast<S>("Simd error: Unknown variant or not supported by this CPU"));
+    }
+    return ks(const_cast<S>(kjson::simd::variant()));
+}
+
+}  // extern "C"
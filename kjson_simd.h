@@ -0,0 +1,39 @@
+#ifndef KJSON_SIMD_H
+#define KJSON_SIMD_H
+
+// Byte-scanning kernels chosen once at load time from the host's CPU
+// features (AVX-512BW, AVX2, SSE4.2 or a portable scalar loop), so a single
+// kjson.so built without -march still uses the widest vectors available.
+
+#include <atomic>
+#include <cstddef>
+
+namespace kjson {
+namespace simd {
+
+struct Kernels {
+    const char* name;
+    // Index of the first '"', '\\' or control character (< 0x20) in
+    // [data, data + len), or len if there is none. These are the bytes a
+    // JSON writer must escape and the only ones that matter inside a string
+    // when looking for its end.
+    size_t (*scan_string)(const char* data, size_t len);
+};
+
+extern std::atomic<const Kernels*> active;
+
+inline size_t scan_string(const char* data, size_t len) {
+    return active.load(std::memory_order_relaxed)->scan_string(data, len);
+}
+
+// Name of the active variant: avx512, avx2, sse42 or scalar
+const char* variant();
+
+// Force a variant by name, or "auto" to return to the detected one. Returns
+// false if the name is unknown or the CPU does not support it.
+bool select(const char* name);
+
+}  // namespace simd
+}  // namespace kjson
+
+#endif  // KJSON_SIMD_H
@@ -1,13 +1,584 @@
 /* File: kjson_utils.cpp */
 
 #include "kjson_utils.h"
+#include "kjson_simd.h"
 #include "k.h" // Include the kdb+ header
 #include <cstring> // For strcmp, memcpy
 #include <cstdio> // For snprintf, sprintf
 
 namespace kjson {
 
-K json_to_kobject_dict(const rapidjson::Value& value)
+// Element idx of an options value list, which q may have collapsed to a typed vector
+static K option_value(K values, J idx, K& owned)
+{
+    owned = nullptr;
+    if (values->t == 0)
+    {
+        return kK(values)[idx];
+    }
+    switch (values->t)
+    {
+        case KJ: return owned = kj(kJ(values)[idx]);
+        case KI: return owned = kj(kI(values)[idx]);
+        case KB: return owned = kb(kG(values)[idx]);
+        case KS: return owned = ks(kS(values)[idx]);
+        case KC: return owned = kc(kC(values)[idx]);
+        default: return owned = ka(101);
+    }
+}
+
+static bool option_long(K x, J& out)
+{
+    switch (x->t)
+    {
+        case -KJ: out = x->j; return true;
+        case -KI: out = x->i; return true;
+        case -KH: out = x->h; return true;
+        default: return false;
+    }
+}
+
+static bool option_fields(K x, FieldSet& out)
+{
+    if (x->t == -KS)
+    {
+        out.emplace(x->s);
+    }
+    else if (x->t == KS)
+    {
+        // Symbols are interned, so the views stay valid
+        for (J idx = 0; idx < x->n; ++idx)
+        {
+            out.emplace(kS(x)[idx]);
+        }
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char* read_parse_options(K opts, ParseOptions& options)
+{
+    if (opts->t == 101)
+    {
+        return nullptr;  // (::) for defaults
+    }
+    if (opts->t != XD || kK(opts)[0]->t != KS)
+    {
+        return "Type error: Options must be a dictionary with symbol keys";
+    }
+
+    const K keys = kK(opts)[0];
+    const K values = kK(opts)[1];
+    const char* error = nullptr;
+
+    for (J idx = 0; idx < keys->n && !error; ++idx)
+    {
+        K owned;
+        const K value = option_value(values, idx, owned);
+        const std::string_view key = kS(keys)[idx];
+
+        if (key == "symbols")
+        {
+            if (!option_fields(value, options.symbols)) error = "Type error: symbols option must be a symbol list";
+        }
+        else if (key == "symthreshold")
+        {
+            if (!option_long(value, options.symbol_threshold)) error = "Type error: symthreshold option must be a long";
+        }
+        else if (key == "keyed")
+        {
+            if (value->t == -KS) options.keyed = value->s;
+            else error = "Type error: keyed option must be a symbol";
+        }
+        else if (key == "flatten")
+        {
+            if (value->t == -KB) options.flatten = value->g;
+            else error = "Type error: flatten option must be a boolean";
+        }
+        else if (key == "depth")
+        {
+            if (!option_long(value, options.depth) || options.depth < 0) error = "Type error: depth option must be a non-negative long";
+        }
+        else if (key == "sep")
+        {
+            if (value->t == -KC) options.sep.assign(1, static_cast<char>(value->g));
+            else if (value->t == KC) options.sep.assign(reinterpret_cast<const char*>(kC(value)), value->n);
+            else error = "Type error: sep option must be a char or string";
+        }
+        else
+        {
+            error = "Option error: Unknown option";
+        }
+
+        if (owned) r0(owned);
+    }
+    return error;
+}
+
+const char* read_serialise_options(K opts, SerialiseOptions& options)
+{
+    if (opts->t == 101)
+    {
+        return nullptr;  // (::) for defaults
+    }
+    if (opts->t != XD || kK(opts)[0]->t != KS)
+    {
+        return "Type error: Options must be a dictionary with symbol keys";
+    }
+
+    const K keys = kK(opts)[0];
+    const K values = kK(opts)[1];
+    const char* error = nullptr;
+
+    for (J idx = 0; idx < keys->n && !error; ++idx)
+    {
+        K owned;
+        const K value = option_value(values, idx, owned);
+        const std::string_view key = kS(keys)[idx];
+
+        if (key == "omitnulls")
+        {
+            if (value->t == -KB) options.omit_nulls = value->g;
+            else error = "Type error: omitnulls option must be a boolean";
+        }
+        else if (key == "defaults")
+        {
+            if (value->t == XD && kK(value)[0]->t == KS) options.defaults = value;
+            else error = "Type error: defaults option must be a dictionary with symbol keys";
+        }
+        else
+        {
+            error = "Option error: Unknown option";
+        }
+
+        if (owned) r0(owned);
+    }
+    return error;
+}
+
+S ParseContext::intern(const char* s, size_t len)
+{
+    const std::string_view view(s, len);
+    auto it = interned_.find(view);
+    if (it != interned_.end())
+    {
+        return it->second;
+    }
+    S sym = sn(const_cast<S>(s), static_cast<I>(len));
+    // The key points into the interned symbol, which q keeps for the life of
+    // the process, not into the document, which the caller may free before
+    // the next lookup. A string with a NUL is cut short by sn, so not cached.
+    if (!memchr(s, 0, len))
+    {
+        interned_.emplace(std::string_view(sym, len), sym);
+    }
+    return sym;
+}
+
+static const rapidjson::Value& element(rapidjson::Value::ConstValueIterator it)
+{
+    return *it;
+}
+
+static const rapidjson::Value& element(rapidjson::Value::ConstMemberIterator it)
+{
+    return it->value;
+}
+
+// String fields of the objects in an array (or the values of an object) that
+// hold at most threshold distinct values (nulls allowed), scanned before any
+// K object is built
+template<typename Iterator>
+static FieldSet low_cardinality_fields(Iterator begin, Iterator end, J threshold)
+{
+    std::unordered_map<std::string_view, FieldSet> distinct;
+    FieldSet rejected;
+
+    for (Iterator it = begin; it != end; ++it)
+    {
+        const rapidjson::Value* elem = &element(it);
+        if (!elem->IsObject())
+        {
+            continue;
+        }
+        for (rapidjson::Value::ConstMemberIterator itr = elem->MemberBegin(); itr != elem->MemberEnd(); ++itr)
+        {
+            const std::string_view name(itr->name.GetString(), itr->name.GetStringLength());
+            if (rejected.count(name))
+            {
+                continue;
+            }
+            if (itr->value.IsNull())
+            {
+                distinct[name];
+                continue;
+            }
+            if (!itr->value.IsString())
+            {
+                rejected.insert(name);
+                distinct.erase(name);
+                continue;
+            }
+            FieldSet& values = distinct[name];
+            values.emplace(itr->value.GetString(), itr->value.GetStringLength());
+            if (static_cast<J>(values.size()) > threshold)
+            {
+                rejected.insert(name);
+                distinct.erase(name);
+            }
+        }
+    }
+
+    FieldSet fields;
+    for (const auto& entry : distinct)
+    {
+        if (!entry.second.empty())
+        {
+            fields.insert(entry.first);
+        }
+    }
+    return fields;
+}
+
+// Whether a member value should be converted to a symbol atom
+static bool is_symbol_field(const ParseContext* ctx, const FieldSet* auto_symbols,
+                            std::string_view name, const rapidjson::Value& value)
+{
+    if (!ctx || !(value.IsString() || value.IsNull()))
+    {
+        return false;
+    }
+    return ctx->options.symbols.count(name) || (auto_symbols && auto_symbols->count(name));
+}
+
+static bool is_symbol_field(const ParseContext* ctx, const FieldSet* auto_symbols,
+                            const rapidjson::Value& name, const rapidjson::Value& value)
+{
+    return is_symbol_field(ctx, auto_symbols, std::string_view(name.GetString(), name.GetStringLength()), value);
+}
+
+// Whether every value of object is an object with the same keys in the same
+// order, none of them named like the key column. A single member is too
+// little evidence, e.g. {"data":{"a":1}} is a wrapper rather than a table.
+static bool uniform_objects(const rapidjson::Value& object, S key)
+{
+    if (object.MemberCount() < 2)
+    {
+        return false;
+    }
+    const rapidjson::Value& first = object.MemberBegin()->value;
+    if (!first.IsObject() || first.MemberCount() == 0)
+    {
+        return false;
+    }
+    for (rapidjson::Value::ConstMemberIterator field = first.MemberBegin(); field != first.MemberEnd(); ++field)
+    {
+        if (strcmp(field->name.GetString(), key) == 0)
+        {
+            return false;
+        }
+    }
+    for (rapidjson::Value::ConstMemberIterator itr = object.MemberBegin() + 1; itr != object.MemberEnd(); ++itr)
+    {
+        const rapidjson::Value& row = itr->value;
+        if (!row.IsObject() || row.MemberCount() != first.MemberCount())
+        {
+            return false;
+        }
+        rapidjson::Value::ConstMemberIterator expected = first.MemberBegin();
+        for (rapidjson::Value::ConstMemberIterator field = row.MemberBegin(); field != row.MemberEnd(); ++field, ++expected)
+        {
+            if (field->name.GetStringLength() != expected->name.GetStringLength() ||
+                memcmp(field->name.GetString(), expected->name.GetString(), field->name.GetStringLength()) != 0)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// One column of a table built from the fields of object values. Every value
+// is observed first to settle the type, as vk would for their atoms, then
+// the vector is allocated and filled in place.
+class ColumnBuilder
+{
+public:
+    ColumnBuilder(ParseContext* ctx, std::string_view name, const FieldSet* auto_symbols)
+        : ctx_(ctx), name_(name), auto_symbols_(auto_symbols) {}
+
+    void observe(const rapidjson::Value& value)
+    {
+        floats_ = floats_ && (value.IsNull() || value.IsNumber());
+        booleans_ = booleans_ && value.IsBool();
+        symbols_ = symbols_ && is_symbol_field(ctx_, auto_symbols_, name_, value);
+    }
+
+    K allocate(J rows)
+    {
+        column_ = ktn(symbols_ ? KS : floats_ ? KF : booleans_ ? KB : 0, rows);
+        return column_;
+    }
+
+    // Fill the next row, returning false if a value fails to convert
+    bool add(const rapidjson::Value& value)
+    {
+        switch (column_->t)
+        {
+            case KS:
+                kS(column_)[filled_] = value.IsNull() ? ss(const_cast<S>("")) : ctx_->intern(value.GetString(), value.GetStringLength());
+                break;
+            case KF:
+                kF(column_)[filled_] = value.IsNull() ? nf : value.GetDouble();
+                break;
+            case KB:
+                kG(column_)[filled_] = value.GetBool();
+                break;
+            default: {
+                K v = is_symbol_field(ctx_, auto_symbols_, name_, value)
+                          ? ks(value.IsNull() ? const_cast<S>("") : ctx_->intern(value.GetString(), value.GetStringLength()))
+                          : json_to_kobject(value, ctx_);
+                if (!v)
+                {
+                    return false;
+                }
+                kK(column_)[filled_] = v;
+                break;
+            }
+        }
+        ++filled_;
+        return true;
+    }
+
+    // Drop the unfilled rows of a general list so it can be released
+    void truncate()
+    {
+        if (column_ && column_->t == 0)
+        {
+            column_->n = filled_;
+        }
+    }
+
+private:
+    ParseContext* ctx_;
+    std::string_view name_;
+    const FieldSet* auto_symbols_;
+    bool floats_ = true;
+    bool booleans_ = true;
+    bool symbols_ = true;
+    K column_ = nullptr;
+    J filled_ = 0;
+};
+
+// An object of uniform objects as a keyed table: the outer keys are a symbol
+// key column named by the keyed option and the inner fields typed columns
+static K json_to_keyed_table(const rapidjson::Value& object, ParseContext* ctx)
+{
+    const J rows = object.MemberCount();
+    const rapidjson::Value& first = object.MemberBegin()->value;
+
+    FieldSet auto_symbols;
+    if (ctx->options.symbol_threshold > 0)
+    {
+        auto_symbols = low_cardinality_fields(object.MemberBegin(), object.MemberEnd(), ctx->options.symbol_threshold);
+    }
+
+    std::vector<ColumnBuilder> columns;
+    columns.reserve(first.MemberCount());
+    for (rapidjson::Value::ConstMemberIterator field = first.MemberBegin(); field != first.MemberEnd(); ++field)
+    {
+        columns.emplace_back(ctx, std::string_view(field->name.GetString(), field->name.GetStringLength()), &auto_symbols);
+    }
+    for (rapidjson::Value::ConstMemberIterator itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr)
+    {
+        size_t col = 0;
+        for (rapidjson::Value::ConstMemberIterator field = itr->value.MemberBegin(); field != itr->value.MemberEnd(); ++field)
+        {
+            columns[col++].observe(field->value);
+        }
+    }
+
+    K keys = ktn(KS, rows);
+    K names = ktn(KS, columns.size());
+    K values = ktn(0, columns.size());
+    size_t col = 0;
+    for (rapidjson::Value::ConstMemberIterator field = first.MemberBegin(); field != first.MemberEnd(); ++field, ++col)
+    {
+        kS(names)[col] = ctx->intern(field->name.GetString(), field->name.GetStringLength());
+        kK(values)[col] = columns[col].allocate(rows);
+    }
+
+    J row = 0;
+    for (rapidjson::Value::ConstMemberIterator itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr, ++row)
+    {
+        kS(keys)[row] = ctx->intern(itr->name.GetString(), itr->name.GetStringLength());
+        col = 0;
+        for (rapidjson::Value::ConstMemberIterator field = itr->value.MemberBegin(); field != itr->value.MemberEnd(); ++field, ++col)
+        {
+            if (!columns[col].add(field->value))
+            {
+                for (ColumnBuilder& column : columns)
+                {
+                    column.truncate();
+                }
+                r0(keys);
+                r0(names);
+                r0(values);
+                return krr((S)"Type error: Failed to convert value");
+            }
+        }
+    }
+
+    K key_name = ktn(KS, 1);
+    kS(key_name)[0] = ctx->options.keyed;
+    return xD(xT(xD(key_name, knk(1, keys))), xT(xD(names, values)));
+}
+
+// Leaves of an array of objects flattened into columns: the joined names
+// in first-row order and every row's values, row-major
+struct FlatColumns
+{
+    std::vector<std::string> names;
+    std::vector<const rapidjson::Value*> cells;
+};
+
+// Append the leaves of object, named from prefix, to flat. The first row
+// sets the column names; later rows must produce the same names in the same
+// order, counted from col, or the array is not flattened.
+static bool flatten_row(const rapidjson::Value& object, const ParseOptions& options, J level, std::string& prefix,
+                        bool first, size_t& col, FlatColumns& flat)
+{
+    const size_t base = prefix.size();
+    for (rapidjson::Value::ConstMemberIterator itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr)
+    {
+        prefix.resize(base);
+        if (level > 0)
+        {
+            prefix += options.sep;
+        }
+        prefix.append(itr->name.GetString(), itr->name.GetStringLength());
+
+        const rapidjson::Value& value = itr->value;
+        if (value.IsObject() && value.MemberCount() > 0 && (options.depth == 0 || level < options.depth))
+        {
+            if (!flatten_row(value, options, level + 1, prefix, first, col, flat))
+            {
+                return false;
+            }
+            continue;
+        }
+        if (first)
+        {
+            flat.names.push_back(prefix);
+        }
+        else if (col >= flat.names.size() || flat.names[col] != prefix)
+        {
+            return false;
+        }
+        flat.cells.push_back(&value);
+        ++col;
+    }
+    prefix.resize(base);
+    return true;
+}
+
+static bool flatten_array(const rapidjson::Value& array, const ParseOptions& options, FlatColumns& flat)
+{
+    std::string prefix;
+    for (rapidjson::SizeType row = 0; row < array.Size(); ++row)
+    {
+        size_t col = 0;
+        if (!array[row].IsObject() || !flatten_row(array[row], options, 0, prefix, row == 0, col, flat) ||
+            col != flat.names.size())
+        {
+            return false;
+        }
+    }
+    // Names must be distinct, which {"a.b":1,"a":{"b":2}} would break
+    const std::unordered_set<std::string_view> distinct(flat.names.begin(), flat.names.end());
+    return !flat.names.empty() && distinct.size() == flat.names.size();
+}
+
+// Flattened columns whose values are all strings with at most threshold
+// distinct values (nulls allowed)
+static FieldSet low_cardinality_columns(const FlatColumns& flat, J threshold)
+{
+    const size_t cols = flat.names.size();
+    const size_t rows = flat.cells.size() / cols;
+    FieldSet fields;
+    for (size_t col = 0; col < cols; ++col)
+    {
+        FieldSet distinct;
+        bool strings = true;
+        for (size_t row = 0; row < rows && strings; ++row)
+        {
+            const rapidjson::Value& value = *flat.cells[row * cols + col];
+            if (value.IsString())
+            {
+                distinct.emplace(value.GetString(), value.GetStringLength());
+            }
+            strings = (value.IsString() || value.IsNull()) && static_cast<J>(distinct.size()) <= threshold;
+        }
+        if (strings && !distinct.empty())
+        {
+            fields.insert(flat.names[col]);
+        }
+    }
+    return fields;
+}
+
+// The flattened columns of an array of objects as a table
+static K json_to_flat_table(const FlatColumns& flat, ParseContext* ctx)
+{
+    const size_t cols = flat.names.size();
+    const J rows = static_cast<J>(flat.cells.size() / cols);
+
+    FieldSet auto_symbols;
+    if (ctx->options.symbol_threshold > 0)
+    {
+        auto_symbols = low_cardinality_columns(flat, ctx->options.symbol_threshold);
+    }
+
+    std::vector<ColumnBuilder> columns;
+    columns.reserve(cols);
+    for (const std::string& name : flat.names)
+    {
+        columns.emplace_back(ctx, name, &auto_symbols);
+    }
+    for (size_t cell = 0; cell < flat.cells.size(); ++cell)
+    {
+        columns[cell % cols].observe(*flat.cells[cell]);
+    }
+
+    K names = ktn(KS, cols);
+    K values = ktn(0, cols);
+    for (size_t col = 0; col < cols; ++col)
+    {
+        // Not through the intern cache, whose views must point into the document
+        kS(names)[col] = sn(const_cast<S>(flat.names[col].data()), static_cast<I>(flat.names[col].size()));
+        kK(values)[col] = columns[col].allocate(rows);
+    }
+
+    for (size_t cell = 0; cell < flat.cells.size(); ++cell)
+    {
+        if (!columns[cell % cols].add(*flat.cells[cell]))
+        {
+            for (ColumnBuilder& column : columns)
+            {
+                column.truncate();
+            }
+            r0(names);
+            r0(values);
+            return krr((S)"Type error: Failed to convert value");
+        }
+    }
+    return xT(xD(names, values));
+}
+
+K json_to_kobject_dict(const rapidjson::Value& value, ParseContext* ctx, const FieldSet* auto_symbols)
 {
     if (value.IsNull())
     {
@@ -15,6 +586,13 @@ K json_to_kobject_dict(const rapidjson::Value& value)
     }
     else if (value.IsObject())
     {
+        // Only the top-level object, so nested objects that happen to hold
+        // a single object stay dictionaries
+        if (ctx && ctx->options.keyed && &value == ctx->root && uniform_objects(value, ctx->options.keyed))
+        {
+            return json_to_keyed_table(value, ctx);
+        }
+
         // Create a dictionary
         rapidjson::SizeType memberCount = value.MemberCount();
         K keys = ktn(KS, memberCount);   // Create symbol list for keys
@@ -33,6 +611,11 @@ K json_to_kobject_dict(const rapidjson::Value& value)
             {
                 allBooleans = false;
             }
+            if (is_symbol_field(ctx, auto_symbols, itr->name, itr->value))
+            {
+                allFloats = false;
+                allBooleans = false;
+            }
         }
 
         K valuesList = nullptr;
@@ -72,10 +655,16 @@ K json_to_kobject_dict(const rapidjson::Value& value)
             {
                 kG(valuesList)[idx] = itr->value.GetBool(); // Assign boolean value directly
             }
+            else if (is_symbol_field(ctx, auto_symbols, itr->name, itr->value))
+            {
+                // Nulls in a symbol field become null symbols
+                kK(valuesList)[idx] = itr->value.IsNull() ? ks(const_cast<S>(""))
+                                                          : ks(ctx->intern(itr->value.GetString(), itr->value.GetStringLength()));
+            }
             else
             {
                 // Mixed list scenario - convert value using json_to_kobject
-                K v = json_to_kobject(itr->value);
+                K v = json_to_kobject(itr->value, ctx);
                 if (!v)
                 {
                     printf("Failed to convert value for key: %s\n", itr->name.GetString());
@@ -106,7 +695,7 @@ K json_to_kobject_dict(const rapidjson::Value& value)
     }
 }
 
-K json_to_kobject(const rapidjson::Value& value)
+K json_to_kobject(const rapidjson::Value& value, ParseContext* ctx)
 {
     if (value.IsNull())
     {
@@ -132,11 +721,29 @@ K json_to_kobject(const rapidjson::Value& value)
             return ktn(0, 0); // Empty general list
         }
 
+        // Arrays of objects that flatten to the same columns become a table
+        if (ctx && ctx->options.flatten && value[0].IsObject())
+        {
+            FlatColumns flat;
+            if (flatten_array(value, ctx->options, flat))
+            {
+                return json_to_flat_table(flat, ctx);
+            }
+        }
+
+        // Low-cardinality string fields of an array of objects become symbols
+        FieldSet auto_symbols;
+        if (ctx && ctx->options.symbol_threshold > 0 && value[0].IsObject())
+        {
+            auto_symbols = low_cardinality_fields(value.Begin(), value.End(), ctx->options.symbol_threshold);
+        }
+
         // Create a general list and populate it with elements
         K list = ktn(0, size);
         for (rapidjson::SizeType i = 0; i < size; ++i)
         {
-            K elem = json_to_kobject(value[i]);
+            K elem = value[i].IsObject() ? json_to_kobject_dict(value[i], ctx, &auto_symbols)
+                                         : json_to_kobject(value[i], ctx);
             if (!elem)
             {
                 r0(list);
@@ -150,9 +757,598 @@ K json_to_kobject(const rapidjson::Value& value)
     }
     else if (value.IsObject())
     {
-        return json_to_kobject_dict(value); // Convert object to dictionary
+        return json_to_kobject_dict(value, ctx); // Convert object to dictionary
     }
     return krr((S)"Unsupported JSON type");
 }
 
+// Writes IPC bytes following the typing rules of json_to_kobject and
+// json_to_kobject_dict, including what vk makes of the array lists
+class IpcEncoder
+{
+public:
+    explicit IpcEncoder(char* out) : out_(out) {}
+
+    size_t size() const { return pos_; }
+
+    void value(const rapidjson::Value& value)
+    {
+        if (value.IsNull() || value.IsNumber())
+        {
+            put<signed char>(-KF);
+            put<F>(value.IsNull() ? null_float : value.GetDouble());
+        }
+        else if (value.IsBool())
+        {
+            put<signed char>(-KB);
+            put<G>(value.GetBool());
+        }
+        else if (value.IsString())
+        {
+            // kp stops at the first NUL
+            const size_t len = strlen(value.GetString());
+            header(KC, len);
+            put(value.GetString(), len);
+        }
+        else if (value.IsArray())
+        {
+            array(value);
+        }
+        else
+        {
+            dict(value);
+        }
+    }
+
+private:
+    enum Kind { Float, Boolean, Object, Other };
+
+    static Kind kind(const rapidjson::Value& value)
+    {
+        if (value.IsNull() || value.IsNumber()) return Float;
+        if (value.IsBool()) return Boolean;
+        if (value.IsObject()) return Object;
+        return Other;
+    }
+
+    void put(const void* data, size_t len)
+    {
+        if (out_)
+        {
+            memcpy(out_ + pos_, data, len);
+        }
+        pos_ += len;
+    }
+
+    template<typename T>
+    void put(T x)
+    {
+        put(&x, sizeof(T));
+    }
+
+    // Vector type, attribute and count
+    void header(signed char t, size_t n)
+    {
+        put<signed char>(t);
+        put<char>(0);
+        put<int32_t>(static_cast<int32_t>(n));
+    }
+
+    void symbols(const rapidjson::Value& object)
+    {
+        header(KS, object.MemberCount());
+        for (auto itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr)
+        {
+            put(itr->name.GetString(), strlen(itr->name.GetString()) + 1);
+        }
+    }
+
+    // A float or boolean vector, or a general list, of the given values,
+    // collapsed as vk collapses a list of their atoms
+    template<typename Cell>
+    void collapsed(size_t n, Cell cell)
+    {
+        bool floats = true;
+        bool booleans = true;
+        for (size_t idx = 0; idx < n; ++idx)
+        {
+            const Kind k = kind(cell(idx));
+            floats = floats && k == Float;
+            booleans = booleans && k == Boolean;
+        }
+        if (floats)
+        {
+            header(KF, n);
+            for (size_t idx = 0; idx < n; ++idx)
+            {
+                const rapidjson::Value& v = cell(idx);
+                put<F>(v.IsNull() ? null_float : v.GetDouble());
+            }
+        }
+        else if (booleans)
+        {
+            header(KB, n);
+            for (size_t idx = 0; idx < n; ++idx)
+            {
+                put<G>(cell(idx).GetBool());
+            }
+        }
+        else
+        {
+            header(0, n);
+            for (size_t idx = 0; idx < n; ++idx)
+            {
+                value(cell(idx));
+            }
+        }
+    }
+
+    void dict(const rapidjson::Value& object)
+    {
+        put<signed char>(XD);
+        symbols(object);
+
+        // Only all-number or all-boolean values are typed; nulls keep the
+        // values a general list
+        bool floats = true;
+        bool booleans = true;
+        for (auto itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr)
+        {
+            floats = floats && itr->value.IsNumber();
+            booleans = booleans && itr->value.IsBool();
+        }
+
+        const size_t n = object.MemberCount();
+        if (floats)
+        {
+            header(KF, n);
+            for (auto itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr)
+            {
+                put<F>(itr->value.GetDouble());
+            }
+        }
+        else if (booleans)
+        {
+            header(KB, n);
+            for (auto itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr)
+            {
+                put<G>(itr->value.GetBool());
+            }
+        }
+        else
+        {
+            header(0, n);
+            for (auto itr = object.MemberBegin(); itr != object.MemberEnd(); ++itr)
+            {
+                value(itr->value);
+            }
+        }
+    }
+
+    // Whether every element is an object with the same non-empty keys
+    static bool conforming(const rapidjson::Value& array)
+    {
+        const rapidjson::Value& first = array[0];
+        if (!first.IsObject() || first.MemberCount() == 0)
+        {
+            return false;
+        }
+        for (rapidjson::SizeType row = 1; row < array.Size(); ++row)
+        {
+            const rapidjson::Value& object = array[row];
+            if (!object.IsObject() || object.MemberCount() != first.MemberCount())
+            {
+                return false;
+            }
+            auto a = first.MemberBegin();
+            for (auto b = object.MemberBegin(); b != object.MemberEnd(); ++a, ++b)
+            {
+                if (strcmp(a->name.GetString(), b->name.GetString()) != 0)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void array(const rapidjson::Value& array)
+    {
+        const rapidjson::SizeType rows = array.Size();
+        if (rows == 0)
+        {
+            header(0, 0);
+        }
+        else if (conforming(array))
+        {
+            // A table: column names from the first object, columns collapsed
+            put<signed char>(XT);
+            put<char>(0);
+            put<signed char>(XD);
+            symbols(array[0]);
+            const rapidjson::SizeType columns = array[0].MemberCount();
+            header(0, columns);
+            for (rapidjson::SizeType col = 0; col < columns; ++col)
+            {
+                collapsed(rows, [&](size_t row) -> const rapidjson::Value& {
+                    return (array[row].MemberBegin() + col)->value;
+                });
+            }
+        }
+        else
+        {
+            collapsed(rows, [&](size_t row) -> const rapidjson::Value& {
+                return array[row];
+            });
+        }
+    }
+
+    const F null_float = nf;  // Same bits as the kf(nf) of json_to_kobject
+    char* out_;
+    size_t pos_ = 0;
+};
+
+size_t json_to_ipc(const rapidjson::Value& value, char* out)
+{
+    IpcEncoder encoder(out);
+    encoder.value(value);
+    return encoder.size();
+}
+
+static inline bool is_separator(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == ',';
+}
+
+void StreamSplitter::begin(size_t pos, char c)
+{
+    in_value_ = true;
+    start_ = pos;
+    escaped_ = false;
+    in_string_ = c == '"';
+    scalar_ = !(c == '{' || c == '[' || c == '"');
+    depth_ = (c == '{' || c == '[') ? 1 : 0;
+}
+
+void StreamSplitter::feed(const char* data, size_t len, std::vector<std::string_view>& values)
+{
+    bool spans = in_value_;  // The current value started in an earlier chunk
+    start_ = 0;
+
+    auto complete = [&](size_t end) {
+        if (spans)
+        {
+            partial_.append(data, end);
+            completed_.swap(partial_);
+            partial_.clear();
+            values.emplace_back(completed_);
+            spans = false;
+        }
+        else
+        {
+            values.emplace_back(data + start_, end - start_);
+        }
+        in_value_ = false;
+    };
+
+    for (size_t pos = 0; pos < len; ++pos)
+    {
+        const char c = data[pos];
+        if (!in_value_)
+        {
+            // Whitespace and commas between top-level values are skipped
+            if (!is_separator(c))
+            {
+                begin(pos, c);
+            }
+        }
+        else if (in_string_)
+        {
+            if (escaped_)
+            {
+                escaped_ = false;
+            }
+            else
+            {
+                // Skip to the next quote, backslash or control character
+                pos += simd::scan_string(data + pos, len - pos);
+                if (pos == len)
+                {
+                    break;
+                }
+                if (data[pos] == '\\')
+                {
+                    escaped_ = true;
+                }
+                else if (data[pos] == '"')
+                {
+                    in_string_ = false;
+                    if (depth_ == 0)
+                    {
+                        complete(pos + 1);
+                    }
+                }
+            }
+        }
+        else if (scalar_)
+        {
+            // A top-level number or literal ends at the next separator or value
+            if (is_separator(c) || c == '{' || c == '[' || c == '"')
+            {
+                complete(pos);
+                if (!is_separator(c))
+                {
+                    begin(pos, c);
+                }
+            }
+        }
+        else
+        {
+            switch (c)
+            {
+                case '"':
+                    in_string_ = true;
+                    break;
+                case '{':
+                case '[':
+                    ++depth_;
+                    break;
+                case '}':
+                case ']':
+                    if (--depth_ == 0)
+                    {
+                        complete(pos + 1);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Keep the unfinished value for the next chunk
+    if (in_value_)
+    {
+        partial_.append(data + start_, len - start_);
+    }
+}
+
+static void intern_plan_keys(ParsePlan& plan)
+{
+    plan.keys = ktn(KS, plan.names.size());
+    for (size_t idx = 0; idx < plan.names.size(); ++idx)
+    {
+        kS(plan.keys)[idx] = ss((S)plan.names[idx].c_str());
+    }
+}
+
+bool compile_parse_plan(ParsePlan& plan, const rapidjson::Value& sample)
+{
+    if (!sample.IsObject())
+    {
+        return false;
+    }
+
+    bool allFloats = true;
+    bool allBooleans = true;
+    for (rapidjson::Value::ConstMemberIterator itr = sample.MemberBegin(); itr != sample.MemberEnd(); ++itr)
+    {
+        plan.names.emplace_back(itr->name.GetString(), itr->name.GetStringLength());
+        allFloats = allFloats && itr->value.IsNumber();
+        allBooleans = allBooleans && itr->value.IsBool();
+    }
+
+    // Same precedence as json_to_kobject_dict
+    plan.values = allFloats ? ParsePlan::Floats : allBooleans ? ParsePlan::Booleans : ParsePlan::Mixed;
+    intern_plan_keys(plan);
+    return true;
+}
+
+bool compile_parse_plan(ParsePlan& plan, K schema)
+{
+    if (schema->t != KS)
+    {
+        return false;
+    }
+
+    for (J idx = 0; idx < schema->n; ++idx)
+    {
+        plan.names.emplace_back(kS(schema)[idx]);
+    }
+
+    // Without sample values every message decides its own values type
+    plan.values = plan.names.empty() ? ParsePlan::Floats : ParsePlan::Mixed;
+    intern_plan_keys(plan);
+    return true;
+}
+
+K json_to_kobject_plan(const ParsePlan& plan, const rapidjson::Value& value)
+{
+    if (!value.IsObject() || value.MemberCount() != plan.names.size())
+    {
+        return nullptr;
+    }
+
+    // Keys must arrive in the expected order
+    rapidjson::SizeType idx = 0;
+    for (rapidjson::Value::ConstMemberIterator itr = value.MemberBegin(); itr != value.MemberEnd(); ++itr, ++idx)
+    {
+        const std::string& name = plan.names[idx];
+        if (itr->name.GetStringLength() != name.size() ||
+            memcmp(itr->name.GetString(), name.data(), name.size()) != 0)
+        {
+            return nullptr;
+        }
+    }
+
+    const rapidjson::SizeType memberCount = value.MemberCount();
+    K valuesList = nullptr;
+    idx = 0;
+
+    switch (plan.values)
+    {
+        case ParsePlan::Floats:
+            valuesList = ktn(KF, memberCount);
+            for (rapidjson::Value::ConstMemberIterator itr = value.MemberBegin(); itr != value.MemberEnd(); ++itr, ++idx)
+            {
+                if (!itr->value.IsNumber())
+                {
+                    r0(valuesList);
+                    return nullptr;
+                }
+                kF(valuesList)[idx] = itr->value.GetDouble();
+            }
+            break;
+        case ParsePlan::Booleans:
+            valuesList = ktn(KB, memberCount);
+            for (rapidjson::Value::ConstMemberIterator itr = value.MemberBegin(); itr != value.MemberEnd(); ++itr, ++idx)
+            {
+                if (!itr->value.IsBool())
+                {
+                    r0(valuesList);
+                    return nullptr;
+                }
+                kG(valuesList)[idx] = itr->value.GetBool();
+            }
+            break;
+        case ParsePlan::Mixed:
+        {
+            bool allFloats = true;
+            bool allBooleans = true;
+            valuesList = ktn(0, memberCount);
+            for (rapidjson::Value::ConstMemberIterator itr = value.MemberBegin(); itr != value.MemberEnd(); ++itr, ++idx)
+            {
+                allFloats = allFloats && itr->value.IsNumber();
+                allBooleans = allBooleans && itr->value.IsBool();
+                K v = json_to_kobject(itr->value);
+                if (!v)
+                {
+                    valuesList->n = idx;
+                    r0(valuesList);
+                    return nullptr;
+                }
+                kK(valuesList)[idx] = v;
+            }
+            // The generic path would have produced a typed list
+            if (allFloats || allBooleans)
+            {
+                r0(valuesList);
+                return nullptr;
+            }
+            break;
+        }
+    }
+
+    return xD(r1(plan.keys), valuesList);
+}
+
+// 16 bytes per step, each folded in with hash_mix
+uint64_t hash_bytes(const char* data, size_t len)
+{
+    const uint64_t k0 = 0xa0761d6478bd642fULL;
+    const uint64_t k1 = 0xe7037ed1a0b428dbULL;
+    uint64_t h = hash_mix(len ^ k0, k1);
+    size_t pos = 0;
+    for (; pos + 16 <= len; pos += 16)
+    {
+        uint64_t a, b;
+        memcpy(&a, data + pos, 8);
+        memcpy(&b, data + pos + 8, 8);
+        h = hash_mix(a ^ k0, b ^ h);
+    }
+    uint64_t a = 0, b = 0;
+    const size_t rest = len - pos;
+    memcpy(&a, data + pos, rest < 8 ? rest : 8);
+    if (rest > 8)
+    {
+        memcpy(&b, data + pos + 8, rest - 8);
+    }
+    return hash_mix(hash_mix(a ^ k0, b ^ h), k1 ^ len);
+}
+
+K ResultCache::find(K json)
+{
+    const uint64_t hash = hash_bytes(reinterpret_cast<const char*>(kC(json)), json->n);
+    auto range = index_.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        K cached = it->second->json;
+        if (cached->n == json->n && (cached == json || memcmp(kC(cached), kC(json), json->n) == 0))
+        {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            ++hits_;
+            return r1(it->second->result);
+        }
+    }
+    ++misses_;
+    return nullptr;
+}
+
+void ResultCache::insert(K json, K result)
+{
+    if (json->n > budget_ || result->t == -128)
+    {
+        return;
+    }
+    evict_until(budget_ - json->n);
+    const uint64_t hash = hash_bytes(reinterpret_cast<const char*>(kC(json)), json->n);
+    lru_.push_front(Entry{hash, r1(json), r1(result)});
+    index_.emplace(hash, lru_.begin());
+    used_ += json->n;
+}
+
+void ResultCache::set_budget(J bytes)
+{
+    budget_ = bytes > 0 ? bytes : 0;
+    evict_until(budget_);
+}
+
+void ResultCache::evict_until(J bytes)
+{
+    while (used_ > bytes && !lru_.empty())
+    {
+        Entry& entry = lru_.back();
+        auto range = index_.equal_range(entry.hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (&*it->second == &entry)
+            {
+                index_.erase(it);
+                break;
+            }
+        }
+        used_ -= entry.json->n;
+        r0(entry.json);
+        r0(entry.result);
+        lru_.pop_back();
+        ++evictions_;
+    }
+}
+
+void ResultCache::clear()
+{
+    for (Entry& entry : lru_)
+    {
+        r0(entry.json);
+        r0(entry.result);
+    }
+    lru_.clear();
+    index_.clear();
+    used_ = 0;
+}
+
+K ResultCache::stats() const
+{
+    K keys = ktn(KS, 6);
+    K values = ktn(KJ, 6);
+    const char* names[] = {"hits", "misses", "evictions", "entries", "bytes", "budget"};
+    const J counters[] = {hits_, misses_, evictions_, static_cast<J>(lru_.size()), used_, budget_};
+    for (int idx = 0; idx < 6; ++idx)
+    {
+        kS(keys)[idx] = ss(const_cast<S>(names[idx]));
+        kJ(values)[idx] = counters[idx];
+    }
+    return xD(keys, values);
+}
+
 } // namespace kjson
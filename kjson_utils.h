@@ -4,6 +4,14 @@
 #define KXVER 3
 #include "k.h"
 #include "rapidjson/document.h" // Add this for rapidjson::Value
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 // Ensure `vk` function uses C linkage to avoid name mangling
 extern "C" {
@@ -11,9 +19,168 @@ extern "C" {
 }
 
 namespace kjson {
+    using FieldSet = std::unordered_set<std::string_view>;
+
+    // Options for jtoko, read from a q dictionary
+    struct ParseOptions {
+        FieldSet symbols;        // Fields whose string values become symbols
+        J symbol_threshold = 0;  // Or any string field of an array of objects with at most this many distinct values
+        S keyed = nullptr;       // Key column for objects of uniform objects, which become keyed tables
+        bool flatten = false;    // Arrays of objects become tables with nested objects as joined columns
+        J depth = 0;             // Levels of nesting flattened, 0 for all
+        std::string sep = ".";   // Joins the names of flattened fields
+    };
+    const char* read_parse_options(K opts, ParseOptions& options);
+
+    // Options for ktojo, borrowed from the options dictionary for one call
+    struct SerialiseOptions {
+        // Leave out fields ktoj would write as null, and null (empty) symbols,
+        // which ktoj writes as "" but are q's null for the type
+        bool omit_nulls = true;
+        K defaults = nullptr;    // Column name to value: fields equal to it are left out
+    };
+    const char* read_serialise_options(K opts, SerialiseOptions& options);
+
+    // State for one conversion: the options and a cache in front of ss()
+    class ParseContext {
+    public:
+        explicit ParseContext(const ParseOptions& options) : options(options) {}
+        const ParseOptions& options;
+        const rapidjson::Value* root = nullptr;  // Document being converted; keyed applies only here
+        S intern(const char* s, size_t len);
+    private:
+        std::unordered_map<std::string_view, S> interned_;  // Keys view the symbols themselves
+    };
+
+    // Splits a byte stream into top-level JSON values. The start of a value
+    // that is split across chunks is kept between calls, so each byte is
+    // scanned once however the stream is fragmented.
+    class StreamSplitter {
+    public:
+        // Append the values completed by this chunk. Views point into data or
+        // into the splitter and stay valid until the next call.
+        void feed(const char* data, size_t len, std::vector<std::string_view>& values);
+    private:
+        void begin(size_t pos, char c);
+        std::string partial_;    // Start of a value split across chunks
+        std::string completed_;  // Split value completed by the current chunk
+        size_t start_ = 0;
+        int depth_ = 0;
+        bool in_value_ = false;
+        bool in_string_ = false;
+        bool escaped_ = false;
+        bool scalar_ = false;
+    };
+
     // Utility functions used for JSON to K and K to JSON conversion
-    K json_to_kobject(const rapidjson::Value& value);
-    K json_to_kobject_dict(const rapidjson::Value& value);
+    K json_to_kobject(const rapidjson::Value& value, ParseContext* ctx = nullptr);
+    K json_to_kobject_dict(const rapidjson::Value& value, ParseContext* ctx = nullptr,
+                           const FieldSet* auto_symbols = nullptr);
+
+    // kdb+ IPC encoding (without the message header) of the object
+    // json_to_kobject would return for value, written without building it.
+    // With out == nullptr only the size is computed.
+    size_t json_to_ipc(const rapidjson::Value& value, char* out);
+
+    // Parse plan for fixed-schema objects: the expected keys in order, their
+    // interned symbol list and the values list type the generic path produces
+    struct ParsePlan {
+        enum Values { Floats, Booleans, Mixed };
+        std::vector<std::string> names;
+        K keys = nullptr;
+        Values values = Mixed;
+        ~ParsePlan() { if (keys) r0(keys); }
+    };
+    bool compile_parse_plan(ParsePlan& plan, const rapidjson::Value& sample);
+    bool compile_parse_plan(ParsePlan& plan, K schema);
+    // Returns nullptr if the value does not match the plan
+    K json_to_kobject_plan(const ParsePlan& plan, const rapidjson::Value& value);
+
+    // Fold two 64-bit values with a 64x64->128 bit multiply
+    inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+        const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+    // Fast non-cryptographic 64-bit hash of a byte range
+    uint64_t hash_bytes(const char* data, size_t len);
+
+    // jtok results keyed by the exact input bytes. Entries hold the input
+    // char vector and the result with r1, are found by hash and confirmed with
+    // a full byte comparison, and are evicted least recently used first once
+    // the input bytes held exceed the budget. A budget of 0 disables it.
+    // Only the input bytes count towards the budget, not the size of the
+    // cached K objects. Errors are never cached.
+    class ResultCache {
+    public:
+        ~ResultCache() { clear(); }
+        // The cached result with an extra reference, or nullptr on a miss
+        K find(K json);
+        void insert(K json, K result);
+        void set_budget(J bytes);
+        K stats() const;
+        bool enabled() const { return budget_ > 0; }
+    private:
+        struct Entry {
+            uint64_t hash;
+            K json;
+            K result;
+        };
+        void evict_until(J bytes);
+        void clear();
+        std::list<Entry> lru_;  // Most recently used first
+        std::unordered_multimap<uint64_t, std::list<Entry>::iterator> index_;
+        J budget_ = 0;
+        J used_ = 0;
+        J hits_ = 0;
+        J misses_ = 0;
+        J evictions_ = 0;
+    };
+
+    // Table of native objects handed out to q as long handles
+    template<typename T>
+    class HandleTable {
+    public:
+        J add(std::unique_ptr<T> item) {
+            J handle = next_++;
+            items_[handle] = std::move(item);
+            return handle;
+        }
+        T* get(J handle) const {
+            auto it = items_.find(handle);
+            return it == items_.end() ? nullptr : it->second.get();
+        }
+        bool erase(J handle) {
+            return items_.erase(handle) > 0;
+        }
+    private:
+        std::unordered_map<J, std::unique_ptr<T>> items_;
+        J next_ = 1;
+    };
+
+    // Read a handle from a long or int atom
+    inline bool get_handle(K x, J& handle) {
+        switch (x->t) {
+            case -KJ: handle = x->j; return true;
+            case -KI: handle = x->i; return true;
+            default: return false;
+        }
+    }
+
+    // Split a table or keyed table into its key and value tables.
+    // Returns the number of parts, or 0 if x is not a table.
+    inline int table_parts(K x, K parts[2]) {
+        if (x->t == XT) {
+            parts[0] = x;
+            return 1;
+        }
+        if (x->t == XD && kK(x)[0]->t == XT && kK(x)[1]->t == XT) {
+            parts[0] = kK(x)[0];
+            parts[1] = kK(x)[1];
+            return 2;
+        }
+        return 0;
+    }
 }
 
 #endif // KJSON_UTILS_H